@@ -0,0 +1,363 @@
+/*
+ * Configuration Management Database Backend Test
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cmdb.h"
+#include "cmdb-backend.h"
+#include "cmdb-storage.h"
+
+static int printer (const void *data, size_t size, void *cookie)
+{
+	printf ("%s = %.*s\n", (const char *) cookie, (int) size,
+		(const char *) data);
+	return 1;
+}
+
+static void show (struct cmdb_backend *o, const char *key)
+{
+	int ret = o->type->fetch (o, key, strlen (key) + 1, printer,
+				  (void *) key);
+
+	if (ret < 0)
+		errx (1, "cannot fetch %s: %s", key, o->type->error (o));
+
+	if (ret == 0)
+		printf ("%s not found\n", key);
+}
+
+static void put (struct cmdb_backend *o, const char *key, const char *value)
+{
+	if (!o->type->store (o, key, strlen (key) + 1, value, strlen (value)))
+		errx (1, "cannot store %s: %s", key, o->type->error (o));
+}
+
+static int counter (const void *key, size_t len, const void *data,
+		    size_t size, void *cookie)
+{
+	size_t *count = cookie;
+
+	++*count;
+	return 1;
+}
+
+static void test_backend (const struct cmdb_backend_type *type,
+			  const char *path)
+{
+	struct cmdb_backend *o;
+	size_t count = 0;
+
+	if ((o = type->open (path, 1)) == NULL)
+		errx (1, "cannot open %s", path);
+
+	if (!type->begin (o))
+		errx (1, "cannot begin: %s", type->error (o));
+
+	put (o, "hostname", "cmdb-test");
+	put (o, "domain",   "example.org");
+
+	if (!type->commit (o, 0))
+		errx (1, "cannot commit: %s", type->error (o));
+
+	if (!type->begin (o))
+		errx (1, "cannot begin: %s", type->error (o));
+
+	put (o, "hostname", "changed");
+	put (o, "location", "lab");
+
+	if (!type->delete (o, "domain", sizeof ("domain")))
+		errx (1, "cannot delete: %s", type->error (o));
+
+	type->cancel (o);
+
+	show (o, "hostname");
+	show (o, "domain");
+	show (o, "location");
+
+	if (!type->iterate (o, counter, &count))
+		errx (1, "cannot iterate: %s", type->error (o));
+
+	printf ("%zu records\n", count);
+
+	if (!type->delete (o, "hostname", sizeof ("hostname")) ||
+	    !type->delete (o, "domain", sizeof ("domain")) ||
+	    !type->delete (o, "location", sizeof ("location")))
+		errx (1, "cannot delete: %s", type->error (o));
+
+	type->close (o);
+}
+
+static void test_shared (void)
+{
+	struct cmdbs *a, *b;
+
+	if ((a = cmdbs_open ("cmdbm-test", "mw")) == NULL)
+		errx (1, "cannot open memory database");
+
+	if (!cmdbs_store (a, "hostname", "cmdb-test") || !cmdbs_flush (a))
+		errx (1, "cannot store: %s", cmdbs_error (a));
+
+	if ((b = cmdbs_open ("cmdbm-test", "m")) == NULL)
+		errx (1, "cannot open memory database again");
+
+	printf ("shared: %s\n", cmdbs_first (b, "hostname"));
+
+	cmdbs_close (b);
+	cmdbs_close (a);
+
+	if ((a = cmdbs_open ("cmdbm-test", "m")) == NULL)
+		errx (1, "cannot reopen memory database");
+
+	printf ("hostname %sfound after close\n",
+		cmdbs_exists (a, "hostname", NULL) ? "" : "not ");
+
+	cmdbs_close (a);
+}
+
+/* changes written on close even if other handle keeps database open */
+/* writer flushes on close even if readers keep database open */
+static void test_close (void)
+{
+	static const char key[] = "\ahostname";  /* attribute of top level */
+	struct cmdb *a, *b;
+	struct cmdb_backend *o;
+
+	if ((a = cmdb_open ("cmdbb-close.db", "rw")) == NULL ||
+	    (b = cmdb_open ("cmdbb-close.db", "r")) == NULL)
+		errx (1, "cannot open database");
+
+	if (!cmdb_delete (a, "hostname", NULL) ||
+	    !cmdb_store (a, "hostname", "closed"))
+		errx (1, "cannot store: %s", cmdb_error (a));
+
+	cmdb_close (a);
+
+	if ((o = cmdb_tdb_type.open ("cmdbb-close.db", 0)) == NULL)
+		errx (1, "cannot open database directly");
+
+	if (o->type->fetch (o, key, sizeof (key), printer, "hostname") <= 0)
+		printf ("hostname not found\n");
+
+	o->type->close (o);
+	cmdb_close (b);
+}
+
+static void test_snapshot (void)
+{
+	struct cmdbs *o;
+	char value[32];
+	const char *p;
+	size_t i, n;
+
+	if ((o = cmdbs_open ("cmdbm-test", "mw")) == NULL)
+		errx (1, "cannot open memory database");
+
+	for (i = 0; i < 1000; ++i) {
+		snprintf (value, sizeof (value), "rule %zu", i);
+
+		if (!cmdbs_store (o, "acl", value))
+			errx (1, "cannot store: %s", cmdbs_error (o));
+	}
+
+	if (!cmdbs_store (o, "hostname", "cmdb-test") ||
+	    !cmdbs_snapshot (o, "cmdbs-test.snap"))
+		errx (1, "cannot make snapshot: %s", cmdbs_error (o));
+
+	cmdbs_close (o);
+
+	if ((o = cmdbs_open ("cmdbs-test.snap", "r")) == NULL)
+		errx (1, "cannot open snapshot");
+
+	for (n = 0, p = cmdbs_first (o, "acl"); p != NULL;
+	     p = cmdbs_next (o, "acl", p))
+		++n;
+
+	printf ("snapshot: hostname = %s, acl: %zu rules, "
+		"rule 7 %sfound, domain %sfound\n",
+		cmdbs_first (o, "hostname"), n,
+		cmdbs_exists (o, "acl", "rule 7") ? "" : "not ",
+		cmdbs_exists (o, "domain", NULL) ? "" : "not ");
+
+	printf ("snapshot %s writable\n",
+		cmdbs_store (o, "domain", "example.org") && cmdbs_flush (o) ?
+		"is" : "is not");
+
+	cmdbs_close (o);
+}
+
+static size_t file_size (const char *path)
+{
+	struct stat st;
+
+	return stat (path, &st) == 0 ? st.st_size : 0;
+}
+
+static void test_journal (void)
+{
+	const char *path = "cmdbj-test.log";
+	struct cmdbs *o;
+	char value[32];
+	size_t i, size, max = 0;
+	int fd;
+
+	unlink (path);
+
+	if ((o = cmdbs_open (path, "jw")) == NULL)
+		errx (1, "cannot open journal");
+
+	/* every flush appends batch, compaction keeps journal small */
+	for (i = 0; i < 10000; ++i) {
+		snprintf (value, sizeof (value), "%zu", i);
+
+		if (!cmdbs_delete (o, "counter", NULL) ||
+		    !cmdbs_store (o, "counter", value) ||
+		    !cmdbs_flush_nosync (o))
+			errx (1, "cannot store: %s", cmdbs_error (o));
+
+		if ((size = file_size (path)) > max)
+			max = size;
+	}
+
+	printf ("journal: %s after 10000 flushes\n",
+		max < 100000 ? "compacted" : "not compacted");
+
+	cmdbs_close (o);
+
+	/* torn batch at the end of journal ignored */
+	if ((fd = open (path, O_WRONLY | O_APPEND)) < 0 ||
+	    write (fd, "cmdj\xff\xff", 6) != 6 || close (fd) != 0)
+		err (1, "cannot append to journal");
+
+	if ((o = cmdbs_open (path, "j")) == NULL)
+		errx (1, "cannot reopen journal");
+
+	printf ("journal: counter = %s\n", cmdbs_first (o, "counter"));
+	cmdbs_close (o);
+}
+
+static void test_compact (const char *path, const char *mode)
+{
+	struct cmdb_compact s;
+	struct cmdbs *o;
+	char value[32];
+	size_t i;
+
+	if ((o = cmdbs_open (path, mode)) == NULL)
+		errx (1, "cannot open %s", path);
+
+	for (i = 0; i < 500; ++i) {
+		snprintf (value, sizeof (value), "rule %zu", i);
+
+		if (!cmdbs_store (o, "acl", value) || !cmdbs_flush (o))
+			errx (1, "cannot store: %s", cmdbs_error (o));
+	}
+
+	if (!cmdbs_delete (o, "acl", NULL) ||
+	    !cmdbs_store (o, "hostname", "cmdb-test") ||
+	    !cmdbs_compact (o, &s))
+		err (1, "cannot compact %s", path);
+
+	printf ("compact: %zu records, %s\n", s.records,
+		s.size_after <= s.size_before ? "not grown" : "grown");
+
+	cmdbs_close (o);
+
+	if ((o = cmdbs_open (path, mode)) == NULL)
+		errx (1, "cannot reopen %s", path);
+
+	printf ("compact: hostname = %s, acl %sfound\n",
+		cmdbs_first (o, "hostname"),
+		cmdbs_exists (o, "acl", NULL) ? "" : "not ");
+
+	if (!cmdbs_delete (o, "hostname", NULL) || !cmdbs_flush (o))
+		errx (1, "cannot delete: %s", cmdbs_error (o));
+
+	cmdbs_close (o);
+}
+
+static void hold_open (const char *path, int ready, int done)
+{
+	struct cmdbs *o;
+	char c;
+
+	if ((o = cmdbs_open (path, "r")) == NULL ||
+	    write (ready, "", 1) != 1 || read (done, &c, 1) != 1)
+		_exit (1);
+
+	cmdbs_close (o);
+	_exit (0);
+}
+
+/* database opened by other process is not replaced under it */
+static void test_compact_busy (const char *path)
+{
+	struct cmdb_compact s;
+	struct cmdbs *o;
+	int ready[2], done[2], status;
+	pid_t pid;
+	char c;
+
+	if (pipe (ready) != 0 || pipe (done) != 0 || (pid = fork ()) < 0)
+		err (1, "cannot start reader");
+
+	if (pid == 0)
+		hold_open (path, ready[1], done[0]);
+
+	if (read (ready[0], &c, 1) != 1)
+		errx (1, "reader failed");
+
+	if ((o = cmdbs_open (path, "rw")) == NULL)
+		errx (1, "cannot open %s", path);
+
+	printf ("compact while open elsewhere: %s\n",
+		cmdbs_compact (o, &s) ? "done" :
+		errno == EBUSY ? "busy" : "failed");
+
+	if (write (done[1], "", 1) != 1 || waitpid (pid, &status, 0) != pid ||
+	    !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+		errx (1, "reader failed");
+
+	printf ("compact after close: %s\n",
+		cmdbs_compact (o, &s) ? "done" : "failed");
+
+	cmdbs_close (o);
+	close (ready[0]);
+	close (ready[1]);
+	close (done[0]);
+	close (done[1]);
+}
+
+int main (int argc, char *argv[])
+{
+	printf ("== tdb\n");
+	test_backend (&cmdb_tdb_type, "cmdbb-test.db");
+
+	printf ("== memory\n");
+	test_backend (&cmdb_memory_type, "cmdbb-test");
+
+	printf ("== journal\n");
+	test_backend (&cmdb_journal_type, "cmdbb-test.log");
+
+	test_shared ();
+	test_close ();
+	test_snapshot ();
+	test_journal ();
+
+	test_compact ("cmdbc-test.db", "rw");
+	test_compact ("cmdbj-test.log", "jw");
+	test_compact_busy ("cmdbc-test.db");
+	return 0;
+}
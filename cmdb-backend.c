@@ -0,0 +1,39 @@
+/*
+ * Configuration Management Database Backend Helpers
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "cmdb-backend.h"
+
+int cmdb_make_path (const char *path)
+{
+	size_t size = strlen (path) + 1;
+	char line[size], *p;
+
+	if (path == NULL || path[0] == '\0') {
+		errno = EINVAL;
+		return 0;
+	}
+
+	strncpy (line, path, size);
+
+	for (p = line + 1; *p != '\0'; ++p)
+		if (*p == '/') {
+			*p = '\0';
+
+			if (mkdir (line, 0777) != 0 && errno != EEXIST)
+				return 0;
+
+			*p = '/';
+		}
+
+	return 1;
+}
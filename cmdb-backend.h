@@ -0,0 +1,81 @@
+/*
+ * Configuration Management Database Backend
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef CMDB_BACKEND_H
+#define CMDB_BACKEND_H  1
+
+#include <stddef.h>
+
+#include "cmdb.h"
+
+/*
+ * Key-value engine under storage. Backend object starts with this
+ * header, engine state follows it.
+ */
+struct cmdb_backend {
+	const struct cmdb_backend_type *type;
+};
+
+/* parser gets data in place, returns 1 on success */
+typedef int cmdb_backend_parser (const void *data, size_t size, void *cookie);
+
+/* visitor returns 1 to continue, 0 to stop iteration with failure */
+typedef int cmdb_backend_visitor (const void *key, size_t len,
+				  const void *data, size_t size, void *cookie);
+
+struct cmdb_backend_type {
+	int mapped;  /* fetched data stays valid until backend closed */
+
+	struct cmdb_backend *(*open) (const char *path, int writable);
+	int (*close) (struct cmdb_backend *o);
+	const char *(*error) (struct cmdb_backend *o);
+
+	/* whether backend opened on database at given path */
+	int (*same) (struct cmdb_backend *o, const char *path);
+
+	/* returns 1 if record parsed, 0 if absent, -1 on failure */
+	int (*fetch) (struct cmdb_backend *o, const void *key, size_t len,
+		      cmdb_backend_parser *fn, void *cookie);
+	int (*store) (struct cmdb_backend *o, const void *key, size_t len,
+		      const void *data, size_t size);
+	/* delete of absent record succeeds */
+	int (*delete) (struct cmdb_backend *o, const void *key, size_t len);
+
+	int  (*begin)  (struct cmdb_backend *o);
+	int  (*commit) (struct cmdb_backend *o, int sync);
+	void (*cancel) (struct cmdb_backend *o);
+
+	int (*iterate) (struct cmdb_backend *o, cmdb_backend_visitor *fn,
+			void *cookie);
+
+	/* hold consistent view of database over many fetches */
+	int  (*lock_read)   (struct cmdb_backend *o);
+	void (*unlock_read) (struct cmdb_backend *o);
+
+	/* rewrite database compactly, NULL if not supported */
+	int (*compact) (struct cmdb_backend *o, struct cmdb_compact *s);
+
+	/* counter of database changes by any process, NULL if unknown */
+	size_t (*version) (struct cmdb_backend *o);
+};
+
+extern const struct cmdb_backend_type cmdb_tdb_type;       /* TDB file */
+extern const struct cmdb_backend_type cmdb_memory_type;    /* process memory */
+extern const struct cmdb_backend_type cmdb_snapshot_type;  /* read-only image */
+extern const struct cmdb_backend_type cmdb_journal_type;   /* append-only log */
+
+/* whether file at path is snapshot */
+int cmdb_snapshot_probe (const char *path);
+
+/* write snapshot of backend contents, atomically replace target file */
+int cmdb_snapshot_save (struct cmdb_backend *o, const char *path);
+
+/* create missing parent directories of path */
+int cmdb_make_path (const char *path);
+
+#endif  /* CMDB_BACKEND_H */
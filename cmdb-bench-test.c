@@ -0,0 +1,122 @@
+/*
+ * Configuration Management Database Benchmark
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <err.h>
+
+#include "cmdb.h"
+
+#define COUNT	100000
+
+static double now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report (const char *name, double start, size_t count)
+{
+	printf ("%-24s %8zu ops, %8.1f ns/op\n",
+		name, count, (now () - start) / count);
+}
+
+static void set_level (struct cmdb *o, int i)
+{
+	char node[32];
+
+	snprintf (node, sizeof (node), "node %d", i);
+
+	if (!cmdb_level (o, "a", "b", "c", "d", "e", "f", "g", node, NULL))
+		errx (1, "cannot set level");
+}
+
+static void store (struct cmdb *o, int i)
+{
+	char name[32], value[32];
+
+	snprintf (name,  sizeof (name),  "attr-%d", i % 100);
+	snprintf (value, sizeof (value), "value %d", i);
+
+	if (!cmdb_store (o, name, value))
+		errx (1, "cannot store: %s", cmdb_error (o));
+}
+
+#define KEYS	100
+
+static void lookup (struct cmdb *o, int i)
+{
+	char name[32];
+
+	snprintf (name, sizeof (name), "attr-%d", i % KEYS);
+
+	if (cmdb_first (o, name) == NULL)
+		errx (1, "cannot find %s", name);
+}
+
+int main (int argc, char *argv[])
+{
+	struct cmdb *o;
+	struct cmdb_key *keys[KEYS];
+	char name[32];
+	double start;
+	int i;
+
+	if ((o = cmdb_open ("cmdb-bench.db", "rwx")) == NULL)
+		errx (1, "cannot open database");
+
+	set_level (o, 0);
+
+	for (start = now (), i = 0; i < COUNT; ++i)
+		store (o, i);
+
+	report ("store, same level", start, COUNT);
+
+	for (start = now (), i = 0; i < COUNT; ++i) {
+		set_level (o, i % 2);
+		store (o, i);
+	}
+
+	report ("store, switch level", start, COUNT);
+
+	set_level (o, 0);
+
+	for (start = now (), i = 0; i < COUNT; ++i)
+		lookup (o, i);
+
+	report ("first, by name", start, COUNT);
+
+	for (i = 0; i < KEYS; ++i) {
+		snprintf (name, sizeof (name), "attr-%d", i);
+
+		if ((keys[i] = cmdb_key_compile (o, name)) == NULL)
+			errx (1, "cannot compile key");
+	}
+
+	for (start = now (), i = 0; i < COUNT; ++i)
+		if (cmdb_first_key (o, keys[i % KEYS]) == NULL)
+			errx (1, "cannot find key");
+
+	report ("first, compiled key", start, COUNT);
+
+	for (i = 0; i < KEYS; ++i)
+		cmdb_key_free (keys[i]);
+
+	if (!cmdb_level (o, NULL) || !cmdb_delete (o, NULL, NULL))
+		errx (1, "cannot drop nodes: %s", cmdb_error (o));
+
+	if (!cmdb_flush_nosync (o))
+		errx (1, "cannot flush: %s", cmdb_error (o));
+
+	cmdb_close (o);
+	return 0;
+}
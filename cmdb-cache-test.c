@@ -66,9 +66,58 @@ static int show (struct cmdbc *o, const char *key, void *cookie)
 	return 1;
 }
 
-static const char *address  = "interfaces\nethernet eth1\aaddress";
 static const char *hostname = "system\ahostname";
 
+/* replaced values space reused: cache does not grow */
+static void test_replace (struct cmdbc *o)
+{
+	char value[32];
+	size_t i, usage = 0;
+
+	cmdbc_delete (o, hostname, NULL);
+
+	for (i = 0; i < 200000; ++i) {
+		snprintf (value, sizeof (value), "host-%zu", i);
+		cmdbc_store (o, hostname, value);
+
+		snprintf (value, sizeof (value), "host-%zu", i - 1);
+		cmdbc_delete (o, hostname, value);
+
+		if (i == 1000)
+			usage = cmdbc_usage (o);
+	}
+
+	printf ("replace: hostname = %s, usage %s\n",
+		cmdbc_first (o, hostname),
+		cmdbc_usage (o) <= usage ? "bounded" : "grown");
+}
+
+/* deleting one value leaves other returned values intact */
+static void test_delete (struct cmdbc *o)
+{
+	char value[32];
+	const char *kept;
+	size_t i;
+
+	cmdbc_delete (o, hostname, NULL);
+
+	for (i = 0; i < 64; ++i) {
+		snprintf (value, sizeof (value), "host-%02zu", i);
+		cmdbc_store (o, hostname, value);
+	}
+
+	kept = cmdbc_first (o, hostname);
+
+	for (i = 1; i < 64; ++i) {
+		snprintf (value, sizeof (value), "host-%02zu", i);
+		cmdbc_delete (o, hostname, value);
+	}
+
+	printf ("delete: kept %s\n", kept);
+}
+
+static const char *address  = "interfaces\nethernet eth1\aaddress";
+
 int main (int argc, char *argv[])
 {
 	struct cmdbc *o;
@@ -94,6 +143,8 @@ int main (int argc, char *argv[])
 
 	cmdbc_flush (o, show, NULL);
 
+	test_replace (o);
+	test_delete (o);
 	cmdbc_free (o);
 	return 0;
 }
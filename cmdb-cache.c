@@ -10,44 +10,252 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <data/hash.h>
+#include <pthread.h>
 #include <data/ht.h>
 #include <data/string.h>
 
 #include "cmdb-cache.h"
+#include "cmdb-hash.h"
+
+/* values owned by record pool, released with it */
+static void value_free (void *o)
+{
+}
 
 static const struct data_type string_type = {
-	.free	= free,
+	.free	= value_free,
 	.eq	= string_eq,
 	.hash	= string_hash,
 };
 
+struct chunk {
+	struct chunk *next;
+	size_t size, used;
+	size_t live;  /* bytes of values still in set */
+	char data[];
+};
+
+#define CHUNK_MIN	64
+#define CHUNK_MAX	65536
+
+/*
+ * Small sets (most attributes hold one value) kept inline and searched
+ * linearly, hash table allocated only when set outgrows inline array.
+ * Inline array is NULL-terminated and kept sorted to serve as sorted
+ * view.
+ */
+#define SET_INLINE	4
+
+struct set {
+	size_t count;  /* inline values count, unused if table allocated */
+	size_t bytes;  /* serialized size: values with terminating NULs */
+	struct ht *table;
+	const char *item[SET_INLINE + 1];
+};
+
+static void set_init (struct set *o)
+{
+	o->count = 0;
+	o->bytes = 0;
+	o->table = NULL;
+	o->item[0] = NULL;
+}
+
+static void set_fini (struct set *o)
+{
+	if (o->table != NULL) {
+		ht_fini (o->table);
+		free (o->table);
+	}
+}
+
+static void set_clean (struct set *o)
+{
+	set_fini (o);
+	set_init (o);
+}
+
+static const char *set_lookup (const struct set *o, const char *value)
+{
+	size_t i;
+
+	if (o->table != NULL)
+		return ht_lookup (o->table, value);
+
+	for (i = 0; i < o->count; ++i)
+		if (strcmp (o->item[i], value) == 0)
+			return o->item[i];
+
+	return NULL;
+}
+
+static int set_promote (struct set *o)
+{
+	struct ht *t;
+	size_t i;
+
+	if ((t = malloc (sizeof (*t))) == NULL)
+		return 0;
+
+	if (!ht_init (t, &string_type))
+		goto no_init;
+
+	for (i = 0; i < o->count; ++i)
+		if (!ht_insert (t, (void *) o->item[i], 0))
+			goto no_insert;
+
+	o->table = t;
+	return 1;
+no_insert:
+	ht_fini (t);
+no_init:
+	free (t);
+	return 0;
+}
+
+/* insert value of length len known to be absent from set */
+static int set_insert (struct set *o, const char *value, size_t len)
+{
+	size_t i;
+
+	if (o->table == NULL && o->count < SET_INLINE) {
+		for (i = o->count; i > 0 && strcoll (o->item[i - 1], value) > 0; --i)
+			o->item[i] = o->item[i - 1];
+
+		o->item[i] = value;
+		o->item[++o->count] = NULL;
+	}
+	else if ((o->table == NULL && !set_promote (o)) ||
+		 !ht_insert (o->table, (void *) value, 0))
+		return 0;
+
+	o->bytes += len + 1;
+	return 1;
+}
+
+static void set_remove (struct set *o, const char *value)
+{
+	size_t i;
+
+	if (o->table != NULL) {
+		if (ht_lookup (o->table, value) != NULL) {
+			o->bytes -= strlen (value) + 1;
+			ht_remove (o->table, value);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < o->count; ++i)
+		if (strcmp (o->item[i], value) == 0) {
+			o->bytes -= strlen (value) + 1;
+
+			for (--o->count; i < o->count; ++i)
+				o->item[i] = o->item[i + 1];
+
+			o->item[o->count] = NULL;
+			return;
+		}
+}
+
+/* set slots: iterate over slots skipping empty (NULL) ones */
+static size_t set_size (const struct set *o)
+{
+	return o->table != NULL ? o->table->size : o->count;
+}
+
+static const char *set_slot (const struct set *o, size_t i)
+{
+	return o->table != NULL ? o->table->table[i] : o->item[i];
+}
+
+static size_t set_usage (const struct set *o)
+{
+	if (o->table == NULL)
+		return 0;
+
+	return sizeof (*o->table) +
+	       o->table->size * sizeof (o->table->table[0]);
+}
+
 struct record {
 	char *key;
-	struct ht set;
+	struct set set;
 	int changed;
+	size_t len, hash;     /* key length and hash */
+	struct record *next;  /* next changed record */
+	struct chunk *pool;   /* value storage */
+	size_t usage;         /* record and pool size in bytes */
+	struct record *lnext, *lprev;  /* clock ring */
+	int used;             /* referenced since last clock pass */
+	const char **sorted;  /* sorted view of set, built on demand */
+	size_t count, pos;    /* sorted view size and iterator position */
+	size_t pins;          /* open cursors count */
+	size_t pages, layout; /* stored and pending page counts */
+	unsigned char *dirty_pages;  /* pages changed since stored */
+	size_t epoch;         /* cache epoch record known valid at */
 };
 
-static struct record *record_alloc (const char *key)
+static struct record *record_alloc (const struct cmdbc_key *k)
 {
+	size_t len = k->len + 1;
 	struct record *o;
 
-	if ((o = malloc (sizeof (*o))) == NULL)
+	/* key stored right after the record */
+	if ((o = malloc (sizeof (*o) + len)) == NULL)
 		return NULL;
 
-	if ((o->key = strdup (key)) == NULL)
-		goto no_key;
+	o->key  = memcpy (o + 1, k->name, len);
+	o->len  = k->len;
+	o->hash = k->hash;
 
-	if (!ht_init (&o->set, &string_type))
-		goto no_set;
+	set_init (&o->set);
 
 	o->changed = 0;
+	o->next  = NULL;
+	o->pool  = NULL;
+	o->usage = sizeof (*o) + len;
+	o->used  = 1;
+	o->sorted = NULL;
+	o->pins   = 0;
+	o->pages  = CMDBC_PAGES_UNKNOWN;
+	o->layout = CMDBC_PAGES_UNKNOWN;
+	o->dirty_pages = NULL;
 	return o;
-no_set:
-	free (o->key);
-no_key:
-	free (o);
-	return NULL;
+}
+
+static void record_reset (struct record *o)
+{
+	struct chunk *c, *next;
+
+	for (c = o->pool; c != NULL; c = next) {
+		next = c->next;
+		o->usage -= sizeof (*c) + c->size;
+		free (c);
+	}
+
+	o->pool = NULL;
+}
+
+static int cmp (const void *a, const void *b)
+{
+	const char *const *p = a;
+	const char *const *q = b;
+
+	return strcoll (*p, *q);
+}
+
+static void record_unsort (struct record *o)
+{
+	if (o->sorted == NULL)
+		return;
+
+	if (o->sorted != o->set.item) {
+		o->usage -= sizeof (o->sorted[0]) * (o->count + 1);
+		free (o->sorted);
+	}
+
+	o->sorted = NULL;
 }
 
 static void record_free (struct record *o)
@@ -55,29 +263,155 @@ static void record_free (struct record *o)
 	if (o == NULL)
 		return;
 
-	ht_fini (&o->set);
-	free (o->key);
+	record_unsort (o);
+	set_fini (&o->set);
+	record_reset (o);
+	free (o->dirty_pages);
 	free (o);
 }
 
+static size_t page_of (const char *value, size_t len, size_t pages)
+{
+	return cmdb_hash_data (value, len) & (pages - 1);
+}
+
+static int record_paged (const struct record *o)
+{
+	return o->pages > 0 && o->pages != CMDBC_PAGES_UNKNOWN;
+}
+
+/* set stored page count, all pages clean */
+static int record_set_pages (struct record *o, size_t pages)
+{
+	size_t old  = record_paged (o) ? (o->pages + 7) / 8 : 0;
+	size_t size = pages > 0 && pages != CMDBC_PAGES_UNKNOWN ?
+		      (pages + 7) / 8 : 0;
+	unsigned char *p = o->dirty_pages;
+
+	if (size != old) {
+		if (size > 0 && (p = realloc (p, size)) == NULL) {
+			/* forget layout: it will be looked up in storage */
+			free (o->dirty_pages);
+			o->dirty_pages = NULL;
+			o->usage -= old;
+			o->pages = o->layout = CMDBC_PAGES_UNKNOWN;
+			return 0;
+		}
+
+		if (size == 0) {
+			free (p);
+			p = NULL;
+		}
+
+		o->usage = o->usage - old + size;
+	}
+
+	if (size > 0)
+		memset (p, 0, size);
+
+	o->dirty_pages = p;
+	o->pages = o->layout = pages;
+	return 1;
+}
+
+static void record_mark (struct record *o, const char *value, size_t len)
+{
+	size_t i;
+
+	if (!record_paged (o))
+		return;
+
+	i = page_of (value, len, o->pages);
+	o->dirty_pages[i / 8] |= 1 << (i % 8);
+}
+
+static void record_mark_all (struct record *o)
+{
+	if (record_paged (o))
+		memset (o->dirty_pages, 0xff, (o->pages + 7) / 8);
+}
+
+/* copy data (string with terminating NUL or string list) into record pool */
+static char *record_copy (struct record *o, const void *data, size_t len)
+{
+	struct chunk *c = o->pool;
+	size_t size;
+	char *p;
+
+	if (c == NULL || c->size - c->used < len) {
+		/* chunk grows with set, not with count of changes */
+		for (
+			size = CHUNK_MIN;
+			size < o->set.bytes && size < CHUNK_MAX;
+			size *= 2
+		) {}
+
+		if (size < len)
+			size = len;
+
+		if ((c = malloc (sizeof (*c) + size)) == NULL)
+			return NULL;
+
+		c->next = o->pool;
+		c->size = size;
+		c->used = 0;
+		c->live = 0;
+
+		o->pool = c;
+		o->usage += sizeof (*c) + size;
+	}
+
+	p = c->data + c->used;
+	c->used += len;
+	c->live += len;
+	return memcpy (p, data, len);
+}
+
+/*
+ * Value removed from set: chunk left without values freed, other values
+ * stay in place. Mapped values are not in pool.
+ */
+static void record_release (struct record *o, const char *value, size_t len)
+{
+	struct chunk **p, *c;
+
+	for (p = &o->pool; (c = *p) != NULL; p = &c->next)
+		if (value >= c->data && value < c->data + c->used) {
+			if ((c->live -= len) == 0) {
+				*p = c->next;
+				o->usage -= sizeof (*c) + c->size;
+				free (c);
+			}
+
+			return;
+		}
+}
+
+static size_t record_usage (const struct record *o)
+{
+	return o->usage + set_usage (&o->set);
+}
+
 static void record_drop (void *o)
 {
 	record_free (o);
 }
 
+/* cheap hash and length checks reject almost all mismatches */
 static int record_eq (const void *a, const void *b)
 {
 	const struct record *p = a;
 	const struct record *q = b;
 
-	return strcmp (p->key, q->key) == 0;
+	return p->hash == q->hash && p->len == q->len &&
+	       memcmp (p->key, q->key, p->len) == 0;
 }
 
 static size_t record_hash (const void *o)
 {
 	const struct record *p = o;
 
-	return hash (0, p->key, strlen (p->key));
+	return p->hash;
 }
 
 static const struct data_type record_type = {
@@ -86,8 +420,19 @@ static const struct data_type record_type = {
 	.hash	= record_hash,
 };
 
+#define EVICTED_BITS	4096
+
 struct cmdbc {
 	struct ht root;
+	struct record *dirty, **tail;  /* list of changed records */
+	size_t usage;                  /* records size in bytes */
+	size_t count, limit;           /* records count, memory limit */
+	struct record *hand;           /* clock hand */
+	cmdb_hash_fn *hash;            /* key hash function */
+	size_t epoch;                  /* older unchanged records stale */
+	struct chunk *retired;         /* pools of replaced records */
+	pthread_mutex_t sort_lock;     /* serializes sorted view builds */
+	unsigned char evicted[EVICTED_BITS / 8];  /* evicted keys filter */
 };
 
 struct cmdbc *cmdbc_alloc (void)
@@ -100,7 +445,22 @@ struct cmdbc *cmdbc_alloc (void)
 	if (!ht_init (&o->root, &record_type))
 		goto no_root;
 
+	if (pthread_mutex_init (&o->sort_lock, NULL) != 0)
+		goto no_lock;
+
+	o->dirty = NULL;
+	o->tail  = &o->dirty;
+	o->usage = 0;
+	o->count = 0;
+	o->limit = 0;
+	o->hand  = NULL;
+	o->hash  = cmdb_hash_data;
+	o->epoch = 0;
+	o->retired = NULL;
+	memset (o->evicted, 0, sizeof (o->evicted));
 	return o;
+no_lock:
+	ht_fini (&o->root);
 no_root:
 	free (o);
 	return NULL;
@@ -112,203 +472,840 @@ void cmdbc_free (struct cmdbc *o)
 		return;
 
 	ht_fini (&o->root);
+	cmdbc_release (o);
+	pthread_mutex_destroy (&o->sort_lock);
 	free (o);
 }
 
-int cmdbc_store (struct cmdbc *o, const char *key, const char *value)
+size_t cmdbc_usage (struct cmdbc *o)
+{
+	return sizeof (*o) + o->root.size * sizeof (o->root.table[0]) +
+	       o->usage;
+}
+
+static void touch (struct cmdbc *o, struct record *r)
+{
+	if (r->changed)
+		return;
+
+	r->changed = 1;
+	r->next = NULL;
+	*o->tail = r;
+	o->tail = &r->next;
+}
+
+/* build sorted view of set, kept until set changed */
+static int record_build (struct cmdbc *c, struct record *o)
 {
-	const struct record sample = { (char *) key };
+	const char **sorted;
+	size_t count, i, size;
+	const char *p;
+
+	if (o->set.table == NULL) {
+		o->count = o->set.count;
+		o->pos   = 0;
+		__atomic_store_n (&o->sorted, o->set.item, __ATOMIC_RELEASE);
+		return 1;
+	}
+
+	for (count = 0, i = 0; i < set_size (&o->set); ++i)
+		if (set_slot (&o->set, i) != NULL)
+			++count;
+
+	size = sizeof (sorted[0]) * (count + 1);
+
+	if ((sorted = malloc (size)) == NULL)
+		return 0;
+
+	for (count = 0, i = 0; i < set_size (&o->set); ++i)
+		if ((p = set_slot (&o->set, i)) != NULL)
+			sorted[count++] = p;
+
+	qsort (sorted, count, sizeof (sorted[0]), cmp);
+	sorted[count] = NULL;
+
+	o->count = count;
+	o->pos   = 0;
+	o->usage += size;
+	c->usage += size;
+	__atomic_store_n (&o->sorted, sorted, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Readers may build sorted view concurrently: builds serialized, view
+ * published when filled. Views dropped by exclusive writers only.
+ */
+static int record_sort (struct cmdbc *c, struct record *o)
+{
+	int ok = 1;
+
+	if (__atomic_load_n (&o->sorted, __ATOMIC_ACQUIRE) != NULL)
+		return 1;
+
+	pthread_mutex_lock (&c->sort_lock);
+
+	if (o->sorted == NULL)
+		ok = record_build (c, o);
+
+	pthread_mutex_unlock (&c->sort_lock);
+	return ok;
+}
+
+int cmdbc_set_hash (struct cmdbc *o, cmdb_hash_fn *fn)
+{
+	if (o->count > 0)
+		return 0;
+
+	o->hash = fn;
+	return 1;
+}
+
+void cmdbc_key_init (struct cmdbc *o, struct cmdbc_key *k, const char *name)
+{
+	k->name = name;
+	k->len  = strlen (name);
+	k->hash = o->hash (name, k->len);
+}
+
+static struct record *record_find (struct cmdbc *o, const struct cmdbc_key *k)
+{
+	const struct record sample = {
+		.key = (char *) k->name, .len = k->len, .hash = k->hash,
+	};
 	struct record *r;
-	char *v;
 
-	if ((r = ht_lookup (&o->root, &sample)) == NULL) {
-		if ((r = record_alloc (key)) == NULL ||
-		    !ht_insert (&o->root, r, 0))
-			return 0;
+	/* shared by readers: avoid writes to record if bit set already */
+	if ((r = ht_lookup (&o->root, &sample)) != NULL &&
+	    !__atomic_load_n (&r->used, __ATOMIC_RELAXED))
+		__atomic_store_n (&r->used, 1, __ATOMIC_RELAXED);
+
+	return r;
+}
+
+static struct record *record_get (struct cmdbc *o, const struct cmdbc_key *k)
+{
+	struct record *r;
+
+	if ((r = record_find (o, k)) != NULL)
+		return r;
+
+	if ((r = record_alloc (k)) == NULL)
+		return NULL;
+
+	r->epoch = o->epoch;
+
+	if (!ht_insert (&o->root, r, 0)) {
+		record_free (r);
+		return NULL;
+	}
+
+	/* insert right behind clock hand */
+	if (o->hand == NULL)
+		o->hand = r->lnext = r->lprev = r;
+	else {
+		r->lnext = o->hand;
+		r->lprev = o->hand->lprev;
+		r->lprev->lnext = r;
+		o->hand->lprev  = r;
 	}
 
-	if ((v = strdup (value)) == NULL)
+	o->usage += record_usage (r);
+	++o->count;
+	return r;
+}
+
+static size_t evicted_bit (size_t hash)
+{
+	return hash % EVICTED_BITS;
+}
+
+static void record_evict (struct cmdbc *o, struct record *r)
+{
+	size_t bit = evicted_bit (r->hash);
+
+	o->evicted[bit / 8] |= 1 << (bit % 8);
+
+	if (r->lnext == r)
+		o->hand = NULL;
+	else {
+		if (o->hand == r)
+			o->hand = r->lnext;
+
+		r->lnext->lprev = r->lprev;
+		r->lprev->lnext = r->lnext;
+	}
+
+	o->usage -= record_usage (r);
+	--o->count;
+	ht_remove (&o->root, r);  /* frees record */
+}
+
+void cmdbc_forget (struct cmdbc *o, const struct cmdbc_key *k)
+{
+	struct record *r;
+
+	if ((r = record_find (o, k)) != NULL && !r->changed && r->pins == 0)
+		record_evict (o, r);
+}
+
+/*
+ * Record dropped, its pool retired: values returned from it stay valid
+ * until released. Record walked by cursor kept.
+ */
+void cmdbc_retire (struct cmdbc *o, const struct cmdbc_key *k)
+{
+	struct record *r;
+	struct chunk *c;
+	size_t size = 0;
+
+	if ((r = record_find (o, k)) == NULL || r->changed || r->pins > 0)
+		return;
+
+	for (c = r->pool; c != NULL; c = c->next) {
+		size += sizeof (*c) + c->size;
+
+		if (c->next == NULL) {
+			c->next = o->retired;
+			o->retired = r->pool;
+			break;
+		}
+	}
+
+	r->pool = NULL;
+	record_evict (o, r);
+	o->usage += size;
+}
+
+void cmdbc_release (struct cmdbc *o)
+{
+	struct chunk *c, *next;
+
+	for (c = o->retired; c != NULL; c = next) {
+		next = c->next;
+		o->usage -= sizeof (*c) + c->size;
+		free (c);
+	}
+
+	o->retired = NULL;
+}
+
+void cmdbc_expire (struct cmdbc *o)
+{
+	__atomic_add_fetch (&o->epoch, 1, __ATOMIC_RELAXED);
+}
+
+int cmdbc_fresh_key (struct cmdbc *o, const struct cmdbc_key *k)
+{
+	const struct record *r;
+
+	if ((r = record_find (o, k)) == NULL)
 		return 0;
 
-	if (!ht_insert (&r->set, v, 1)) {
-		free (v);
+	return r->changed ||
+	       r->epoch == __atomic_load_n (&o->epoch, __ATOMIC_RELAXED);
+}
+
+/* paged records never match: their main key holds page directory */
+int cmdbc_equal_key (struct cmdbc *o, const struct cmdbc_key *k,
+		     const void *data, size_t size)
+{
+	const struct record *r;
+	const char *p = data, *entry;
+	size_t i, len;
+
+	if ((r = record_find (o, k)) == NULL || record_paged (r) ||
+	    r->set.bytes != size)
 		return 0;
+
+	for (i = 0; i < set_size (&r->set); ++i)
+		if ((entry = set_slot (&r->set, i)) != NULL) {
+			len = strlen (entry) + 1;
+
+			if (memcmp (p, entry, len) != 0)
+				return 0;
+
+			p += len;
+		}
+
+	return 1;
+}
+
+void cmdbc_renew (struct cmdbc *o, const struct cmdbc_key *k)
+{
+	struct record *r;
+
+	if ((r = record_find (o, k)) != NULL)
+		r->epoch = __atomic_load_n (&o->epoch, __ATOMIC_RELAXED);
+}
+
+void cmdbc_limit (struct cmdbc *o, size_t limit)
+{
+	o->limit = limit;
+}
+
+int cmdbc_limited (struct cmdbc *o)
+{
+	return o->limit != 0;
+}
+
+/*
+ * Clock sweep: referenced records get second chance, changed records
+ * and records with open cursors never evicted. Stops after two full
+ * turns at most.
+ */
+size_t cmdbc_trim (struct cmdbc *o)
+{
+	size_t count, steps, n;
+	struct record *r;
+
+	for (
+		count = 2 * o->count, steps = 0, n = 0;
+		o->limit != 0 && cmdbc_usage (o) > o->limit &&
+		o->hand != NULL && steps < count;
+		++steps
+	) {
+		r = o->hand;
+		o->hand = r->lnext;
+
+		if (r->changed || r->pins > 0)
+			continue;
+
+		if (r->used) {
+			r->used = 0;
+			continue;
+		}
+
+		record_evict (o, r);
+		++n;
 	}
 
-	r->changed = 1;
+	return n;
+}
+
+int cmdbc_evicted (struct cmdbc *o, const struct cmdbc_key *k)
+{
+	size_t bit = evicted_bit (k->hash);
+	int ret = (o->evicted[bit / 8] & (1 << (bit % 8))) != 0;
+
+	o->evicted[bit / 8] &= ~(1 << (bit % 8));
+	return ret;
+}
+
+/* returns 1 if value added, 0 if it is present already, -1 on error */
+static int record_add (struct record *o, const char *value)
+{
+	size_t len;
+	char *v;
+
+	if (set_lookup (&o->set, value) != NULL)
+		return 0;
+
+	len = strlen (value);
+
+	if ((v = record_copy (o, value, len + 1)) == NULL ||
+	    !set_insert (&o->set, v, len))
+		return -1;
+
+	record_mark (o, v, len);
 	return 1;
 }
 
-void cmdbc_delete (struct cmdbc *o, const char *key, const char *value)
+int cmdbc_store (struct cmdbc *o, const char *key, const char *value)
+{
+	const char *list[] = { value, NULL };
+
+	return cmdbc_store_list (o, key, list);
+}
+
+int cmdbc_store_list (struct cmdbc *o, const char *key, const char **list)
+{
+	struct cmdbc_key k;
+
+	cmdbc_key_init (o, &k, key);
+	return cmdbc_store_list_key (o, &k, list);
+}
+
+int cmdbc_store_list_key (struct cmdbc *o, const struct cmdbc_key *k,
+			  const char **list)
 {
-	const struct record sample = { (char *) key };
 	struct record *r;
+	size_t before;
+	int ret, changed = 0;
 
-	if ((r = ht_lookup (&o->root, &sample)) == NULL)
-		return;
+	if ((r = record_get (o, k)) == NULL)
+		return 0;
 
-	if (value != NULL)
-		ht_remove (&r->set, value);
-	else
-		ht_clean (&r->set);
+	before = record_usage (r);
 
-	r->changed = 1;
+	for (ret = 0; *list != NULL && (ret = record_add (r, *list)) >= 0; ++list)
+		changed |= ret;
+
+	if (changed) {
+		record_unsort (r);
+		touch (o, r);
+	}
+
+	o->usage += record_usage (r) - before;
+	return ret >= 0;
+}
+
+/*
+ * Whole set removal does not need previous values: absent record
+ * created empty and marked changed to be dropped from storage on flush.
+ */
+int cmdbc_delete (struct cmdbc *o, const char *key, const char *value)
+{
+	struct cmdbc_key k;
+	struct record *r;
+	const char *p;
+	size_t before;
+
+	cmdbc_key_init (o, &k, key);
+	r = value != NULL ? record_find (o, &k) : record_get (o, &k);
+
+	if (r == NULL)
+		return value != NULL;
+
+	before = record_usage (r);
+	record_unsort (r);
+
+	if (value != NULL) {
+		record_mark (r, value, strlen (value));
+
+		if ((p = set_lookup (&r->set, value)) != NULL) {
+			set_remove (&r->set, p);
+			record_release (r, p, strlen (p) + 1);
+		}
+	}
+	else {
+		set_clean (&r->set);
+		record_reset (r);
+		record_mark_all (r);
+	}
+
+	o->usage += record_usage (r) - before;
+	touch (o, r);
+	return 1;
+}
+
+/*
+ * Target record replaced with exact copy of source set, values copied
+ * directly between record pools.
+ */
+int cmdbc_copy (struct cmdbc *o, const char *from, const char *to)
+{
+	struct cmdbc_key fk, tk;
+	struct record *s, *d;
+	const char *p;
+	size_t before, i;
+	int ok = 1;
+
+	cmdbc_key_init (o, &fk, from);
+	cmdbc_key_init (o, &tk, to);
+
+	if ((s = record_find (o, &fk)) == NULL ||
+	    (d = record_get (o, &tk)) == NULL)
+		return 0;
+
+	if (s == d)
+		return 1;
+
+	before = record_usage (d);
+	record_unsort (d);
+	set_clean (&d->set);
+	record_reset (d);
+	record_mark_all (d);
+
+	for (i = 0; i < set_size (&s->set); ++i)
+		if ((p = set_slot (&s->set, i)) != NULL && record_add (d, p) < 0) {
+			ok = 0;
+			break;
+		}
+
+	o->usage += record_usage (d) - before;
+	touch (o, d);
+	return ok;
 }
 
 int cmdbc_exists (struct cmdbc *o, const char *key, const char *value)
 {
-	const struct record sample = { (char *) key }, *r;
+	struct cmdbc_key k;
+
+	cmdbc_key_init (o, &k, key);
+	return cmdbc_exists_key (o, &k, value);
+}
+
+int cmdbc_exists_key (struct cmdbc *o, const struct cmdbc_key *k,
+		      const char *value)
+{
+	const struct record *r;
 
-	if ((r = ht_lookup (&o->root, &sample)) == NULL)
+	if ((r = record_find (o, k)) == NULL)
 		return 0;
 
-	return value == NULL || ht_lookup (&r->set, value) != NULL;
+	return value == NULL || set_lookup (&r->set, value) != NULL;
 }
 
 const char *cmdbc_first (struct cmdbc *o, const char *key)
 {
-	const struct record sample = { (char *) key }, *r;
-	size_t i;
+	struct cmdbc_key k;
 
-	if ((r = ht_lookup (&o->root, &sample)) == NULL)
-		return NULL;
+	cmdbc_key_init (o, &k, key);
+	return cmdbc_first_key (o, &k);
+}
 
-	/* find first entry */
-	for (i = 0; i < r->set.size; ++i)
-		if (r->set.table[i] != NULL)
-			return r->set.table[i];
+const char *cmdbc_first_key (struct cmdbc *o, const struct cmdbc_key *k)
+{
+	struct record *r;
 
-	return NULL;
+	if ((r = record_find (o, k)) == NULL || !record_sort (o, r))
+		return NULL;
+
+	__atomic_store_n (&r->pos, 0, __ATOMIC_RELAXED);
+	return r->sorted[0];
 }
 
+/*
+ * Sequential walk takes next entry of sorted view directly, otherwise
+ * walk continues from the first entry greater than the value passed,
+ * thus it survives removal of the current entry.
+ */
 const char *cmdbc_next (struct cmdbc *o, const char *key, const char *value)
 {
-	const struct record sample = { (char *) key }, *r;
-	size_t i;
+	struct cmdbc_key k;
 
-	if ((r = ht_lookup (&o->root, &sample)) == NULL)
-		return NULL;
+	cmdbc_key_init (o, &k, key);
+	return cmdbc_next_key (o, &k, value);
+}
 
-	i = ht_index (&r->set, value);
-	if (r->set.table[i] == NULL)
+const char *cmdbc_next_key (struct cmdbc *o, const struct cmdbc_key *k,
+			    const char *value)
+{
+	struct record *r;
+	size_t pos, lo, hi, mid;
+
+	if ((r = record_find (o, k)) == NULL || !record_sort (o, r))
 		return NULL;
 
-	/* find next entry */
-	for (++i; i < r->set.size; ++i)
-		if (r->set.table[i] != NULL)
-			return r->set.table[i];
+	pos = __atomic_load_n (&r->pos, __ATOMIC_RELAXED);
 
-	return NULL;
+	if (pos < r->count && r->sorted[pos] == value) {
+		__atomic_store_n (&r->pos, ++pos, __ATOMIC_RELAXED);
+		return r->sorted[pos];
+	}
+
+	for (lo = 0, hi = r->count; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+
+		if (strcoll (r->sorted[mid], value) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < r->count && strcmp (r->sorted[lo], value) == 0)
+		++lo;
+
+	__atomic_store_n (&r->pos, lo, __ATOMIC_RELAXED);
+	return r->sorted[lo];
 }
 
-static int cmp (const void *a, const void *b)
+const char **cmdbc_list (struct cmdbc *o, const char *key)
 {
-	const char *const *p = a;
-	const char *const *q = b;
+	struct cmdbc_key k;
 
-	return strcoll (*p, *q);
+	cmdbc_key_init (o, &k, key);
+	return cmdbc_list_key (o, &k);
 }
 
-const char **cmdbc_list (struct cmdbc *o, const char *key)
+const char **cmdbc_list_key (struct cmdbc *o, const struct cmdbc_key *k)
 {
-	const struct record sample = { (char *) key }, *r;
-	size_t count, i;
+	struct record *r;
 	const char **list;
+	size_t size;
 
-	if ((r = ht_lookup (&o->root, &sample)) == NULL)
+	if ((r = record_find (o, k)) == NULL || !record_sort (o, r))
 		return NULL;
 
-	for (count = 0, i = 0; i < r->set.size; ++i)
-		if (r->set.table[i] != NULL)
-			++count;
+	size = sizeof (list[0]) * (r->count + 1);
 
-	if ((list = malloc (sizeof (list[0]) * (count + 1))) == NULL)
+	if ((list = malloc (size)) == NULL)
 		return NULL;
 
-	for (count = 0, i = 0; i < r->set.size; ++i)
-		if (r->set.table[i] != NULL)
-			list[count++] = r->set.table[i];
+	return memcpy (list, r->sorted, size);
+}
+
+int cmdbc_cursor_init (struct cmdbc *o, struct cmdbc_cursor *c,
+		       const char *key)
+{
+	struct cmdbc_key k;
+	struct record *r;
+
+	cmdbc_key_init (o, &k, key);
+
+	if ((r = record_find (o, &k)) == NULL)
+		return 0;
+
+	__atomic_add_fetch (&r->pins, 1, __ATOMIC_RELAXED);
+
+	c->cache  = o;
+	c->record = r;
+	c->pos    = 0;
+	return 1;
+}
+
+void cmdbc_cursor_fini (struct cmdbc_cursor *c)
+{
+	struct record *r = c->record;
+
+	__atomic_sub_fetch (&r->pins, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Cursor walks sorted view by index: no key or value hashing. If set
+ * changed in between, view rebuilt and walk continues at the same index.
+ */
+const char *cmdbc_cursor_next (struct cmdbc_cursor *c)
+{
+	struct record *r = c->record;
+
+	if (!record_sort (c->cache, r) || c->pos >= r->count)
+		return NULL;
 
-	qsort (list, count, sizeof (list[0]), cmp);
-	list[count] = NULL;
-	return list;
+	return r->sorted[c->pos++];
 }
 
+/*
+ * Whole list copied into record pool at once, values referenced in place.
+ */
 int cmdbc_import (struct cmdbc *o, const char *key, const void *data,
 		  size_t size)
 {
-	const struct record sample = { (char *) key };
+	struct cmdbc_key k;
+
+	cmdbc_key_init (o, &k, key);
+	return cmdbc_import_key (o, &k, data, size);
+}
+
+static int import (struct cmdbc *o, const struct cmdbc_key *k,
+		   const void *data, size_t size, int copy)
+{
 	struct record *r;
 	const char *p;
-	size_t avail, len;
-	char *v;
+	size_t before, avail, len;
+	int ok = 1;
 
-	if ((r = ht_lookup (&o->root, &sample)) == NULL) {
-		if ((r = record_alloc (key)) == NULL ||
-		    !ht_insert (&o->root, r, 0))
-			return 0;
-	}
+	if ((r = record_get (o, k)) == NULL)
+		return 0;
 
-	for (
-		p = data, avail = size;
-		(len = strnlen (p, avail)) < avail;
-		++len, p += len, avail -= len
-	) {
-		if ((v = strdup (p)) == NULL)
-			return 0;
+	if (size == 0)
+		return 1;
 
-		if (ht_insert (&r->set, v, 1))
-			continue;
+	before = record_usage (r);
+	record_unsort (r);
 
-		free (v);
-		return 0;
-	}
+	if ((p = copy ? record_copy (r, data, size) : data) == NULL)
+		ok = 0;
+	else
+		for (
+			avail = size;
+			(len = strnlen (p, avail)) < avail;
+			++len, p += len, avail -= len
+		)
+			if (set_lookup (&r->set, p) == NULL &&
+			    !set_insert (&r->set, p, len)) {
+				ok = 0;
+				break;
+			}
+
+	o->usage += record_usage (r) - before;
+	return ok;
+}
 
-	return 1;
+int cmdbc_import_key (struct cmdbc *o, const struct cmdbc_key *k,
+		      const void *data, size_t size)
+{
+	return import (o, k, data, size, 1);
 }
 
+int cmdbc_import_mapped (struct cmdbc *o, const struct cmdbc_key *k,
+			 const void *data, size_t size)
+{
+	return import (o, k, data, size, 0);
+}
+
+/*
+ * Serialized size tracked by set on every change: export is a single
+ * copy pass, and size query does not touch values at all.
+ */
 size_t cmdbc_export (struct cmdbc *o, const char *key, void *data,
 		     size_t avail)
 {
-	const struct record sample = { (char *) key }, *r;
+	struct cmdbc_key k;
+	const struct record *r;
 	size_t size, i, len;
 	const char *entry;
 	char *p;
 
-	if ((r = ht_lookup (&o->root, &sample)) == NULL)
-		return 0;
+	cmdbc_key_init (o, &k, key);
 
-	for (size = 0, i = 0; i < r->set.size; ++i)
-		if ((entry = r->set.table[i]) != NULL)
-			size += snprintf (NULL, 0, "%s", entry) + 1;
-
-	if (size == 0)
+	if ((r = record_find (o, &k)) == NULL)
 		return 0;
 
-	if (size > avail)
+	if ((size = r->set.bytes) == 0 || size > avail)
 		return size;
 
-	for (p = data, i = 0; i < r->set.size; ++i)
-		if ((entry = r->set.table[i]) != NULL) {
-			len = snprintf (p, avail, "%s", entry) + 1;
-			p += len, avail -= len;
+	for (p = data, i = 0; i < set_size (&r->set); ++i)
+		if ((entry = set_slot (&r->set, i)) != NULL) {
+			len = strlen (entry) + 1;
+			memcpy (p, entry, len);
+			p += len;
 		}
 
 	return size;
 }
 
-int cmdbc_flush (struct cmdbc *o, cmdbc_visitor *fn, void *cookie)
+size_t cmdbc_pages (struct cmdbc *o, const char *key)
+{
+	struct cmdbc_key k;
+	const struct record *r;
+
+	cmdbc_key_init (o, &k, key);
+
+	if ((r = record_find (o, &k)) == NULL)
+		return CMDBC_PAGES_UNKNOWN;
+
+	return r->pages;
+}
+
+int cmdbc_set_pages (struct cmdbc *o, const struct cmdbc_key *k, size_t pages)
 {
-	size_t i;
 	struct record *r;
+	size_t before;
+	int ok;
 
-	for (i = 0; i < o->root.size; ++i)
-		if ((r = o->root.table[i]) != NULL && r->changed) {
-			if (!fn (o, r->key, cookie))
-				return 0;
-			else
-				r->changed = 0;
+	if ((r = record_find (o, k)) == NULL)
+		return 0;
+
+	before = r->usage;
+	ok = record_set_pages (r, pages);
+	o->usage += r->usage - before;
+	return ok;
+}
+
+void cmdbc_set_layout (struct cmdbc *o, const char *key, size_t pages)
+{
+	struct cmdbc_key k;
+	struct record *r;
+
+	cmdbc_key_init (o, &k, key);
+
+	if ((r = record_find (o, &k)) != NULL)
+		r->layout = pages;
+}
+
+static int page_selected (const struct record *r, size_t pages, size_t i)
+{
+	return pages != r->pages ||
+	       (r->dirty_pages[i / 8] & (1 << (i % 8))) != 0;
+}
+
+/*
+ * Values spread over pages by stable hash. Selected pages gathered in
+ * one buffer with counting sort: each value hashed twice, copied once.
+ */
+int cmdbc_export_pages (struct cmdbc *o, const char *key, size_t pages,
+			cmdbc_page_visitor *fn, void *cookie)
+{
+	struct cmdbc_key k;
+	const struct record *r;
+	size_t *size, *pos, i, j, len, total;
+	const char *entry;
+	char *buf;
+	int ok = 1;
+
+	cmdbc_key_init (o, &k, key);
+
+	if ((r = record_find (o, &k)) == NULL ||
+	    (size = calloc (pages * 2, sizeof (size[0]))) == NULL)
+		return 0;
+
+	pos = size + pages;
+
+	for (total = 0, i = 0; i < set_size (&r->set); ++i)
+		if ((entry = set_slot (&r->set, i)) != NULL) {
+			len = strlen (entry);
+			j = page_of (entry, len, pages);
+
+			if (page_selected (r, pages, j))
+				size[j] += len + 1, total += len + 1;
 		}
 
+	if ((buf = malloc (total + 1)) == NULL) {
+		free (size);
+		return 0;
+	}
+
+	for (total = 0, j = 0; j < pages; ++j)
+		pos[j] = total, total += size[j];
+
+	for (i = 0; i < set_size (&r->set); ++i)
+		if ((entry = set_slot (&r->set, i)) != NULL) {
+			len = strlen (entry);
+			j = page_of (entry, len, pages);
+
+			if (page_selected (r, pages, j)) {
+				memcpy (buf + pos[j], entry, len + 1);
+				pos[j] += len + 1;
+			}
+		}
+
+	for (j = 0; ok && j < pages; ++j)
+		if (page_selected (r, pages, j))
+			ok = fn (o, key, j, buf + pos[j] - size[j], size[j],
+				 cookie);
+
+	free (buf);
+	free (size);
+	return ok;
+}
+
+int cmdbc_scan (struct cmdbc *o, cmdbc_visitor *fn, void *cookie)
+{
+	struct record *r;
+
+	for (r = o->dirty; r != NULL; r = r->next)
+		if (!fn (o, r->key, cookie))
+			return 0;
+
+	return 1;
+}
+
+void cmdbc_clean (struct cmdbc *o)
+{
+	struct record *r;
+	size_t before;
+
+	for (r = o->dirty; r != NULL; r = r->next) {
+		r->changed = 0;
+		r->epoch   = __atomic_load_n (&o->epoch, __ATOMIC_RELAXED);
+
+		/* pending layout stored now */
+		before = r->usage;
+		record_set_pages (r, r->layout);
+		o->usage += r->usage - before;
+	}
+
+	o->dirty = NULL;
+	o->tail  = &o->dirty;
+}
+
+int cmdbc_flush (struct cmdbc *o, cmdbc_visitor *fn, void *cookie)
+{
+	if (!cmdbc_scan (o, fn, cookie))
+		return 0;
+
+	cmdbc_clean (o);
 	return 1;
 }
@@ -7,29 +7,130 @@
  */
 
 #ifndef CMDB_CACHE_H
-#define CMDB_CECHE_H  1
+#define CMDB_CACHE_H  1
 
 #include <stddef.h>
 
+#include "cmdb-hash.h"
+
+struct cmdbc_key {
+	const char *name;
+	size_t len, hash;
+};
+
 struct cmdbc *cmdbc_alloc (void);
 void cmdbc_free (struct cmdbc *o);
 
+/* select key hash function, cache should be empty */
+int cmdbc_set_hash (struct cmdbc *o, cmdb_hash_fn *fn);
+
+/* prepare key to be used for repeated access without rehashing */
+void cmdbc_key_init (struct cmdbc *o, struct cmdbc_key *k, const char *name);
+
+/* memory used by cache in bytes */
+size_t cmdbc_usage (struct cmdbc *o);
+
+/* set memory limit for cache, zero for unlimited */
+void cmdbc_limit (struct cmdbc *o, size_t limit);
+/* whether memory limit set */
+int cmdbc_limited (struct cmdbc *o);
+/* evict unchanged records until cache fits into limit, returns count */
+size_t cmdbc_trim (struct cmdbc *o);
+/* drop unchanged record, e.g. partially fetched one */
+void cmdbc_forget (struct cmdbc *o, const struct cmdbc_key *k);
+/* test and forget whether the key (probably) was evicted */
+int cmdbc_evicted (struct cmdbc *o, const struct cmdbc_key *k);
+
+/*
+ * Database changed behind cache: unchanged records become stale. Stale
+ * record renewed if it still matches database, otherwise retired.
+ */
+void cmdbc_expire (struct cmdbc *o);
+/* drop record keeping its values, free values of retired records */
+void cmdbc_retire  (struct cmdbc *o, const struct cmdbc_key *k);
+void cmdbc_release (struct cmdbc *o);
+/* whether record cached and not stale */
+int  cmdbc_fresh_key (struct cmdbc *o, const struct cmdbc_key *k);
+/* whether cached record matches serialized one */
+int  cmdbc_equal_key (struct cmdbc *o, const struct cmdbc_key *k,
+		      const void *data, size_t size);
+void cmdbc_renew (struct cmdbc *o, const struct cmdbc_key *k);
+
 int cmdbc_exists (struct cmdbc *o, const char *key, const char *value);
 const char *cmdbc_first (struct cmdbc *o, const char *key);
 const char *cmdbc_next  (struct cmdbc *o, const char *key, const char *value);
 
 const char **cmdbc_list (struct cmdbc *o, const char *key);
 
+int cmdbc_exists_key (struct cmdbc *o, const struct cmdbc_key *k,
+		      const char *value);
+const char *cmdbc_first_key (struct cmdbc *o, const struct cmdbc_key *k);
+const char *cmdbc_next_key  (struct cmdbc *o, const struct cmdbc_key *k,
+			     const char *value);
+
+const char **cmdbc_list_key (struct cmdbc *o, const struct cmdbc_key *k);
+
+struct cmdbc_cursor {
+	struct cmdbc *cache;
+	void *record;
+	size_t pos;
+};
+
+/* cursor pins record in cache until finished */
+int  cmdbc_cursor_init (struct cmdbc *o, struct cmdbc_cursor *c,
+			const char *key);
+void cmdbc_cursor_fini (struct cmdbc_cursor *c);
+const char *cmdbc_cursor_next (struct cmdbc_cursor *c);
+
 int  cmdbc_store  (struct cmdbc *o, const char *key, const char *value);
-void cmdbc_delete (struct cmdbc *o, const char *key, const char *value);
+/* store NULL-terminated list of values */
+int  cmdbc_store_list (struct cmdbc *o, const char *key, const char **list);
+int  cmdbc_store_list_key (struct cmdbc *o, const struct cmdbc_key *k,
+			   const char **list);
+int  cmdbc_delete (struct cmdbc *o, const char *key, const char *value);
+/* replace set of target record with a copy of source one */
+int  cmdbc_copy   (struct cmdbc *o, const char *from, const char *to);
 
 int cmdbc_import (struct cmdbc *o, const char *key, const void *data,
 		  size_t size);
+int cmdbc_import_key (struct cmdbc *o, const struct cmdbc_key *k,
+		      const void *data, size_t size);
+/* values referenced in place: data should outlive the cache */
+int cmdbc_import_mapped (struct cmdbc *o, const struct cmdbc_key *k,
+			 const void *data, size_t size);
 size_t cmdbc_export (struct cmdbc *o, const char *key, void *data,
 		     size_t size);
 
+/*
+ * Large sets stored in pages, record remembers stored page count (zero
+ * for single record, unknown if record not fetched) and changed pages.
+ */
+#define CMDBC_PAGES_UNKNOWN	((size_t) -1)
+
+size_t cmdbc_pages (struct cmdbc *o, const char *key);
+/* set stored page count of fetched record */
+int cmdbc_set_pages (struct cmdbc *o, const struct cmdbc_key *k, size_t pages);
+/* set page count to be stored on next clean */
+void cmdbc_set_layout (struct cmdbc *o, const char *key, size_t pages);
+
+typedef int cmdbc_page_visitor (struct cmdbc *o, const char *key, size_t i,
+				const void *data, size_t size, void *cookie);
+
+/*
+ * Visit changed pages of set spread over power of two number of pages,
+ * or all pages if page count differs from stored one.
+ */
+int cmdbc_export_pages (struct cmdbc *o, const char *key, size_t pages,
+			cmdbc_page_visitor *fn, void *cookie);
+
 typedef int cmdbc_visitor (struct cmdbc *o, const char *key, void *cookie);
 
+/* visit changed records, stop on first failure */
+int  cmdbc_scan  (struct cmdbc *o, cmdbc_visitor *fn, void *cookie);
+/* mark all records as unchanged */
+void cmdbc_clean (struct cmdbc *o);
+
+/* scan and mark records as unchanged if all of them visited successfully */
 int cmdbc_flush (struct cmdbc *o, cmdbc_visitor *fn, void *cookie);
 
 #endif  /* CMDB_CACHE_H */
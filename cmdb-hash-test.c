@@ -0,0 +1,93 @@
+/*
+ * Configuration Management Database Key Hashes Benchmark
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <err.h>
+
+#include "cmdb-cache.h"
+#include "cmdb-hash.h"
+
+#define KEYS	256
+#define COUNT	1000000
+
+static char keys[KEYS][192];
+
+static double now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report (const char *name, const char *test, double start)
+{
+	printf ("%-6s %-8s %8.1f ns/op\n", name, test, (now () - start) / COUNT);
+}
+
+/* deep paths alike ones built by cmdb_path */
+static void make_keys (void)
+{
+	int i;
+
+	for (i = 0; i < KEYS; ++i)
+		snprintf (keys[i], sizeof (keys[i]),
+			  "\ninterfaces\nbridge br0\nmember\ninterface eth%d"
+			  "\nvlan %d\nfirewall\nin\nname filter-%d\nrule %d"
+			  "\naction\adescription-of-the-attribute-%d",
+			  i % 16, i, i * 7, i * 13, i);
+}
+
+static void test (const char *name, cmdb_hash_fn *fn)
+{
+	struct cmdbc *o;
+	struct cmdbc_key k[KEYS];
+	volatile size_t sink = 0;
+	double start;
+	int i;
+
+	for (start = now (), i = 0; i < COUNT; ++i)
+		sink += fn (keys[i % KEYS], 160);
+
+	report (name, "hash", start);
+
+	if ((o = cmdbc_alloc ()) == NULL || !cmdbc_set_hash (o, fn))
+		errx (1, "cannot allocate cache");
+
+	for (i = 0; i < KEYS; ++i)
+		if (!cmdbc_store (o, keys[i], "value"))
+			errx (1, "cannot store");
+
+	for (start = now (), i = 0; i < COUNT; ++i)
+		if (!cmdbc_exists (o, keys[i % KEYS], NULL))
+			errx (1, "cannot find key");
+
+	report (name, "lookup", start);
+
+	for (i = 0; i < KEYS; ++i)
+		cmdbc_key_init (o, k + i, keys[i]);
+
+	for (start = now (), i = 0; i < COUNT; ++i)
+		if (!cmdbc_exists_key (o, k + i % KEYS, NULL))
+			errx (1, "cannot find key");
+
+	report (name, "key", start);
+	cmdbc_free (o);
+}
+
+int main (int argc, char *argv[])
+{
+	make_keys ();
+
+	test ("data", cmdb_hash_data);
+	test ("fast", cmdb_hash_fast);
+	return 0;
+}
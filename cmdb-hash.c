@@ -0,0 +1,53 @@
+/*
+ * Configuration Management Database Key Hashes
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <data/hash.h>
+
+#include "cmdb-hash.h"
+
+size_t cmdb_hash_data (const void *data, size_t len)
+{
+	return hash (0, data, len);
+}
+
+#define K0	0x9e3779b97f4a7c15ull
+#define K1	0xbf58476d1ce4e5b9ull
+
+static uint64_t mix (uint64_t h, uint64_t w)
+{
+	h = (h ^ w) * K0;
+	return h ^ (h >> 29);
+}
+
+/*
+ * Eight bytes consumed per step, tail zero-padded. Word loaded with
+ * memcpy: no alignment requirements. Result depends on byte order,
+ * thus it should not be stored.
+ */
+size_t cmdb_hash_fast (const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t h = len * K1, w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy (&w, p, 8);
+		h = mix (h, w);
+	}
+
+	if (len > 0) {
+		w = 0;
+		memcpy (&w, p, len);
+		h = mix (h, w);
+	}
+
+	h = (h ^ (h >> 32)) * K1;
+	return h ^ (h >> 31);
+}
@@ -0,0 +1,22 @@
+/*
+ * Configuration Management Database Key Hashes
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef CMDB_HASH_H
+#define CMDB_HASH_H  1
+
+#include <stddef.h>
+
+typedef size_t cmdb_hash_fn (const void *data, size_t len);
+
+/* byte-at-a-time hash of data library, stable between runs */
+size_t cmdb_hash_data (const void *data, size_t len);
+
+/* word-at-a-time multiplicative hash, fast for long keys */
+size_t cmdb_hash_fast (const void *data, size_t len);
+
+#endif  /* CMDB_HASH_H */
@@ -0,0 +1,575 @@
+/*
+ * Configuration Management Database Journal Backend
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cmdb-backend.h"
+#include "cmdb-hash.h"
+
+/*
+ * Journal is a sequence of batches, one per commit: header with payload
+ * size and checksum, then operations. Operation is key and data sizes,
+ * then key and data; deletion has no data. Batch that does not match
+ * its checksum (torn write) ends journal. Numbers stored in host byte
+ * order.
+ */
+#define JOURNAL_MAGIC	0x6a646d63
+#define JOURNAL_DELETE	UINT32_MAX
+
+struct head {
+	uint32_t magic, size, sum;
+};
+
+struct op {
+	uint32_t len, size;
+};
+
+static uint32_t checksum (const void *data, size_t size)
+{
+	return cmdb_hash_data (data, size);
+}
+
+/*
+ * Records served from in-memory index replayed at open. Writer holds
+ * journal exclusively, readers see journal as of their open.
+ */
+struct cmdb_journal {
+	struct cmdb_backend backend;
+	struct cmdb_backend *index;
+	char *path;
+	int fd, writable, started, error;
+	char *batch;        /* pending batch */
+	size_t len, avail;
+	size_t size;        /* journal size */
+	size_t live, saved; /* size of live records, saved at begin */
+	dev_t dev;          /* identity of journal file */
+	ino_t ino;
+};
+
+/* journal compacted when garbage exceeds live records and this size */
+#define COMPACT_MIN	65536
+
+static int fail (struct cmdb_journal *o, int error)
+{
+	o->error = error;
+	return 0;
+}
+
+static int reserve (struct cmdb_journal *o, size_t size)
+{
+	size_t avail;
+	char *p;
+
+	if (o->avail - o->len >= size)
+		return 1;
+
+	for (avail = o->avail > 0 ? o->avail : 4096;
+	     avail - o->len < size; avail *= 2) {}
+
+	if ((p = realloc (o->batch, avail)) == NULL)
+		return fail (o, ENOMEM);
+
+	o->batch = p;
+	o->avail = avail;
+	return 1;
+}
+
+static int append (struct cmdb_journal *o, const void *key, size_t len,
+		   const void *data, size_t size, int delete)
+{
+	struct op op;
+
+	if (len >= JOURNAL_DELETE || size >= JOURNAL_DELETE)
+		return fail (o, EFBIG);
+
+	if (!reserve (o, sizeof (op) + len + size))
+		return 0;
+
+	op.len  = len;
+	op.size = delete ? JOURNAL_DELETE : size;
+
+	memcpy (o->batch + o->len, &op, sizeof (op));
+	memcpy (o->batch + o->len + sizeof (op), key, len);
+
+	if (size > 0)
+		memcpy (o->batch + o->len + sizeof (op) + len, data, size);
+
+	o->len += sizeof (op) + len + size;
+	return 1;
+}
+
+static int sizer (const void *data, size_t size, void *cookie)
+{
+	size_t *p = cookie;
+
+	*p = size;
+	return 1;
+}
+
+/* size of record in journal format, zero if absent */
+static size_t record_size (struct cmdb_journal *o, const void *key,
+			   size_t len)
+{
+	struct cmdb_backend *x = o->index;
+	size_t size;
+
+	if (x->type->fetch (x, key, len, sizer, &size) <= 0)
+		return 0;
+
+	return sizeof (struct op) + len + size;
+}
+
+static int index_store (struct cmdb_journal *o, const void *key, size_t len,
+			const void *data, size_t size)
+{
+	struct cmdb_backend *x = o->index;
+	size_t old = record_size (o, key, len);
+
+	if (!x->type->store (x, key, len, data, size))
+		return fail (o, ENOMEM);
+
+	o->live = o->live - old + sizeof (struct op) + len + size;
+	return 1;
+}
+
+static int index_delete (struct cmdb_journal *o, const void *key, size_t len)
+{
+	struct cmdb_backend *x = o->index;
+	size_t old = record_size (o, key, len);
+
+	if (!x->type->delete (x, key, len))
+		return fail (o, ENOMEM);
+
+	o->live -= old;
+	return 1;
+}
+
+/* apply batch payload to index, it checked by checksum already */
+static int apply (struct cmdb_journal *o, const char *p, size_t size)
+{
+	struct op op;
+	int ok;
+
+	while (size > 0) {
+		if (size < sizeof (op))
+			return fail (o, EINVAL);
+
+		memcpy (&op, p, sizeof (op));
+		p += sizeof (op), size -= sizeof (op);
+
+		if (op.size == JOURNAL_DELETE) {
+			if (op.len > size)
+				return fail (o, EINVAL);
+
+			ok = index_delete (o, p, op.len);
+			p += op.len, size -= op.len;
+		}
+		else {
+			if (op.len > size || op.size > size - op.len)
+				return fail (o, EINVAL);
+
+			ok = index_store (o, p, op.len, p + op.len, op.size);
+			p += op.len + op.size, size -= op.len + op.size;
+		}
+
+		if (!ok)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int replay (struct cmdb_journal *o)
+{
+	struct cmdb_backend *x = o->index;
+	struct stat st;
+	struct head h;
+	const char *base;
+	size_t size, pos;
+	int ok = 1;
+
+	if (fstat (o->fd, &st) != 0)
+		return fail (o, errno);
+
+	o->dev = st.st_dev;
+	o->ino = st.st_ino;
+
+	if ((size = st.st_size) == 0)
+		return 1;
+
+	base = mmap (NULL, size, PROT_READ, MAP_PRIVATE, o->fd, 0);
+	if (base == MAP_FAILED)
+		return fail (o, errno);
+
+	for (
+		pos = 0;
+		ok && size - pos >= sizeof (h);
+		pos += sizeof (h) + h.size
+	) {
+		memcpy (&h, base + pos, sizeof (h));
+
+		if (h.magic != JOURNAL_MAGIC ||
+		    h.size > size - pos - sizeof (h) ||
+		    h.sum != checksum (base + pos + sizeof (h), h.size))
+			break;
+
+		ok = x->type->begin (x) &&
+		     apply (o, base + pos + sizeof (h), h.size) &&
+		     x->type->commit (x, 0);
+	}
+
+	munmap ((void *) base, size);
+	o->size = pos;
+
+	/* drop torn tail: next batch appended right after last good one */
+	if (ok && pos < size && o->writable && ftruncate (o->fd, pos) != 0)
+		return fail (o, errno);
+
+	return ok;
+}
+
+static int write_all (int fd, const char *p, size_t size)
+{
+	ssize_t n;
+
+	for (; size > 0; p += n, size -= n)
+		if ((n = write (fd, p, size)) < 0) {
+			if (errno == EINTR)
+				n = 0;
+			else
+				return 0;
+		}
+
+	return 1;
+}
+
+/* make header of pending batch, payload follows reserved header space */
+static void seal (struct cmdb_journal *o)
+{
+	struct head h;
+
+	h.magic = JOURNAL_MAGIC;
+	h.size  = o->len - sizeof (h);
+	h.sum   = checksum (o->batch + sizeof (h), h.size);
+
+	memcpy (o->batch, &h, sizeof (h));
+}
+
+static int collector (const void *key, size_t len, const void *data,
+		      size_t size, void *cookie)
+{
+	return append (cookie, key, len, data, size, 0);
+}
+
+/*
+ * Live records written as one batch to temporary file renamed over
+ * journal then. Journal stays valid if compaction fails.
+ */
+static int compact (struct cmdb_journal *o)
+{
+	struct cmdb_backend *x = o->index;
+	char tmp[strlen (o->path) + 8];
+	struct stat st;
+	int fd;
+
+	o->len = 0;
+
+	if (!reserve (o, sizeof (struct head)))
+		return 0;
+
+	o->len = sizeof (struct head);
+
+	if (!x->type->iterate (x, collector, o))
+		return 0;
+
+	seal (o);
+	snprintf (tmp, sizeof (tmp), "%s.XXXXXX", o->path);
+
+	if ((fd = mkstemp (tmp)) < 0)
+		return fail (o, errno);
+
+	if (fstat (o->fd, &st) != 0 || fchmod (fd, st.st_mode & 0777) != 0 ||
+	    fcntl (fd, F_SETFL, O_APPEND) != 0 ||
+	    flock (fd, LOCK_EX | LOCK_NB) != 0 ||
+	    !write_all (fd, o->batch, o->len) || fsync (fd) != 0 ||
+	    fstat (fd, &st) != 0 || rename (tmp, o->path) != 0)
+		goto no_rename;
+
+	close (o->fd);
+
+	o->fd   = fd;
+	o->size = o->len;
+	o->dev  = st.st_dev;
+	o->ino  = st.st_ino;
+	return 1;
+no_rename:
+	o->error = errno;
+	close (fd);
+	unlink (tmp);
+	return 0;
+}
+
+static int garbage (const struct cmdb_journal *o)
+{
+	return o->size > 2 * o->live + COMPACT_MIN;
+}
+
+static struct cmdb_backend *journal_open (const char *path, int writable)
+{
+	struct cmdb_journal *o;
+	int flags = writable ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY;
+
+	if ((o = malloc (sizeof (*o))) == NULL)
+		return NULL;
+
+	o->backend.type = &cmdb_journal_type;
+
+	if ((o->index = cmdb_memory_type.open (path, 1)) == NULL)
+		goto no_index;
+
+	if ((o->path = strdup (path)) == NULL)
+		goto no_path;
+
+	if (writable && !cmdb_make_path (path))
+		goto no_file;
+
+	if ((o->fd = open (path, flags, 0666)) < 0)
+		goto no_file;
+
+	/* single writer: index of other one would go stale */
+	if (writable && flock (o->fd, LOCK_EX | LOCK_NB) != 0) {
+		errno = EBUSY;
+		goto no_replay;
+	}
+
+	o->writable = writable;
+	o->started  = 0;
+	o->error    = 0;
+	o->batch    = NULL;
+	o->len      = 0;
+	o->avail    = 0;
+	o->size     = 0;
+	o->live     = 0;
+
+	if (!replay (o)) {
+		errno = o->error;
+		goto no_replay;
+	}
+
+	if (writable && garbage (o))
+		compact (o);
+
+	return &o->backend;
+no_replay:
+	free (o->batch);
+	close (o->fd);
+no_file:
+	free (o->path);
+no_path:
+	o->index->type->close (o->index);
+no_index:
+	free (o);
+	return NULL;
+}
+
+static int journal_close (struct cmdb_backend *b)
+{
+	struct cmdb_journal *o = (void *) b;
+	int ok = close (o->fd) == 0;
+
+	o->index->type->close (o->index);
+	free (o->batch);
+	free (o->path);
+	free (o);
+	return ok;
+}
+
+static const char *journal_error (struct cmdb_backend *b)
+{
+	struct cmdb_journal *o = (void *) b;
+
+	return strerror (o->error);
+}
+
+static int journal_same (struct cmdb_backend *b, const char *path)
+{
+	struct cmdb_journal *o = (void *) b;
+	struct stat st;
+
+	return stat (path, &st) == 0 &&
+	       o->dev == st.st_dev && o->ino == st.st_ino;
+}
+
+static int journal_fetch (struct cmdb_backend *b, const void *key,
+			  size_t len, cmdb_backend_parser *fn, void *cookie)
+{
+	struct cmdb_journal *o = (void *) b;
+
+	return o->index->type->fetch (o->index, key, len, fn, cookie);
+}
+
+static int journal_begin (struct cmdb_backend *b)
+{
+	struct cmdb_journal *o = (void *) b;
+	struct cmdb_backend *x = o->index;
+
+	if (!o->writable)
+		return fail (o, EROFS);
+
+	o->len = 0;
+
+	if (!reserve (o, sizeof (struct head)) || !x->type->begin (x))
+		return 0;
+
+	o->len     = sizeof (struct head);
+	o->saved   = o->live;
+	o->started = 1;
+	return 1;
+}
+
+static void journal_cancel (struct cmdb_backend *b)
+{
+	struct cmdb_journal *o = (void *) b;
+
+	o->index->type->cancel (o->index);
+	o->live    = o->saved;
+	o->started = 0;
+}
+
+/*
+ * Whole batch written at once and synced once: it reaches the disk
+ * completely or fails checksum on replay.
+ */
+static int journal_commit (struct cmdb_backend *b, int sync)
+{
+	struct cmdb_journal *o = (void *) b;
+
+	if (o->len > sizeof (struct head)) {
+		seal (o);
+
+		if (!write_all (o->fd, o->batch, o->len) ||
+		    (sync && fdatasync (o->fd) != 0)) {
+			o->error = errno;
+			ftruncate (o->fd, o->size);
+			journal_cancel (b);
+			return 0;
+		}
+
+		o->size += o->len;
+	}
+
+	o->index->type->commit (o->index, sync);
+	o->started = 0;
+
+	if (garbage (o))
+		compact (o);  /* old journal still valid on failure */
+
+	return 1;
+}
+
+static int journal_store (struct cmdb_backend *b, const void *key,
+			  size_t len, const void *data, size_t size)
+{
+	struct cmdb_journal *o = (void *) b;
+
+	if (!o->started)
+		return journal_begin (b) &&
+		       journal_store (b, key, len, data, size) &&
+		       journal_commit (b, 1);
+
+	return append (o, key, len, data, size, 0) &&
+	       index_store (o, key, len, data, size);
+}
+
+static int journal_delete (struct cmdb_backend *b, const void *key,
+			   size_t len)
+{
+	struct cmdb_journal *o = (void *) b;
+
+	if (!o->started)
+		return journal_begin (b) &&
+		       journal_delete (b, key, len) &&
+		       journal_commit (b, 1);
+
+	if (record_size (o, key, len) == 0)
+		return 1;
+
+	return append (o, key, len, NULL, 0, 1) &&
+	       index_delete (o, key, len);
+}
+
+static int journal_iterate (struct cmdb_backend *b, cmdb_backend_visitor *fn,
+			    void *cookie)
+{
+	struct cmdb_journal *o = (void *) b;
+
+	return o->index->type->iterate (o->index, fn, cookie);
+}
+
+/* index never changes under reader: writers serialized by storage */
+static int journal_lock_read (struct cmdb_backend *b)
+{
+	return 1;
+}
+
+static void journal_unlock_read (struct cmdb_backend *b)
+{
+}
+
+static int counter (const void *key, size_t len, const void *data,
+		    size_t size, void *cookie)
+{
+	size_t *count = cookie;
+
+	++*count;
+	return 1;
+}
+
+static int journal_compact (struct cmdb_backend *b, struct cmdb_compact *s)
+{
+	struct cmdb_journal *o = (void *) b;
+
+	if (!o->writable)
+		return fail (o, EROFS);
+
+	s->size_before = o->size;
+
+	if (!o->index->type->iterate (o->index, counter, &s->records) ||
+	    !compact (o))
+		return 0;
+
+	s->size_after = o->size;
+	return 1;
+}
+
+const struct cmdb_backend_type cmdb_journal_type = {
+	.open		= journal_open,
+	.close		= journal_close,
+	.error		= journal_error,
+	.same		= journal_same,
+	.fetch		= journal_fetch,
+	.store		= journal_store,
+	.delete		= journal_delete,
+	.begin		= journal_begin,
+	.commit		= journal_commit,
+	.cancel		= journal_cancel,
+	.iterate	= journal_iterate,
+	.lock_read	= journal_lock_read,
+	.unlock_read	= journal_unlock_read,
+	.compact	= journal_compact,
+};
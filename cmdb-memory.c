@@ -0,0 +1,339 @@
+/*
+ * Configuration Management Database Memory Backend
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <data/ht.h>
+
+#include "cmdb-backend.h"
+#include "cmdb-hash.h"
+
+/* key and data stored in one block right after entry */
+struct entry {
+	size_t hash, len, size;
+	const char *key;
+	const char *data;
+};
+
+static int entry_eq (const void *a, const void *b)
+{
+	const struct entry *p = a, *q = b;
+
+	return p->hash == q->hash && p->len == q->len &&
+	       memcmp (p->key, q->key, p->len) == 0;
+}
+
+static size_t entry_hash (const void *o)
+{
+	const struct entry *p = o;
+
+	return p->hash;
+}
+
+/* entries owned by backend: replaced ones may be kept for rollback */
+static void entry_free (void *o)
+{
+}
+
+static const struct data_type entry_type = {
+	.free	= entry_free,
+	.eq	= entry_eq,
+	.hash	= entry_hash,
+};
+
+static struct entry *
+entry_alloc (const void *key, size_t len, const void *data, size_t size)
+{
+	struct entry *e;
+	char *p;
+
+	if ((e = malloc (sizeof (*e) + len + size)) == NULL)
+		return NULL;
+
+	p = (void *) (e + 1);
+
+	e->hash = cmdb_hash_fast (key, len);
+	e->len  = len;
+	e->size = size;
+	e->key  = memcpy (p, key, len);
+	e->data = memcpy (p + len, data, size);
+	return e;
+}
+
+static void entry_sample (struct entry *e, const void *key, size_t len)
+{
+	e->hash = cmdb_hash_fast (key, len);
+	e->len  = len;
+	e->size = 0;
+	e->key  = key;
+	e->data = NULL;
+}
+
+/*
+ * Changes made in transaction recorded in undo log: previous entry or
+ * key of absent record. Rollback replays log backwards.
+ */
+struct undo {
+	struct undo *next;
+	struct entry *entry;
+	int absent;
+};
+
+struct cmdb_memory {
+	struct cmdb_backend backend;
+	struct ht table;
+	struct undo *undo;
+	char *path;
+	int writable, started, error;
+};
+
+static struct cmdb_backend *mem_open (const char *path, int writable)
+{
+	struct cmdb_memory *o;
+
+	if ((o = malloc (sizeof (*o))) == NULL)
+		return NULL;
+
+	o->backend.type = &cmdb_memory_type;
+
+	if (!ht_init (&o->table, &entry_type))
+		goto no_table;
+
+	if ((o->path = strdup (path)) == NULL)
+		goto no_path;
+
+	o->undo     = NULL;
+	o->writable = writable;
+	o->started  = 0;
+	o->error    = 0;
+	return &o->backend;
+no_path:
+	ht_fini (&o->table);
+no_table:
+	free (o);
+	return NULL;
+}
+
+static void undo_clean (struct cmdb_memory *o)
+{
+	struct undo *u, *next;
+
+	for (u = o->undo; u != NULL; u = next) {
+		next = u->next;
+		free (u->entry);
+		free (u);
+	}
+
+	o->undo = NULL;
+}
+
+static int mem_close (struct cmdb_backend *b)
+{
+	struct cmdb_memory *o = (void *) b;
+	size_t i;
+
+	undo_clean (o);
+
+	for (i = 0; i < o->table.size; ++i)
+		free (o->table.table[i]);
+
+	ht_fini (&o->table);
+	free (o->path);
+	free (o);
+	return 1;
+}
+
+static const char *mem_error (struct cmdb_backend *b)
+{
+	struct cmdb_memory *o = (void *) b;
+
+	return strerror (o->error);
+}
+
+/* in-memory databases shared by name */
+static int mem_same (struct cmdb_backend *b, const char *path)
+{
+	struct cmdb_memory *o = (void *) b;
+
+	return strcmp (o->path, path) == 0;
+}
+
+static int mem_fetch (struct cmdb_backend *b, const void *key, size_t len,
+		      cmdb_backend_parser *fn, void *cookie)
+{
+	struct cmdb_memory *o = (void *) b;
+	struct entry sample, *e;
+
+	entry_sample (&sample, key, len);
+
+	if ((e = ht_lookup (&o->table, &sample)) == NULL)
+		return 0;
+
+	return fn (e->data, e->size, cookie) ? 1 : -1;
+}
+
+static int fail (struct cmdb_memory *o, int error)
+{
+	o->error = error;
+	return 0;
+}
+
+/* save previous state of record, free it if no transaction started */
+static int keep (struct cmdb_memory *o, struct entry *old,
+		 const void *key, size_t len)
+{
+	struct undo *u;
+
+	if (!o->started) {
+		free (old);
+		return 1;
+	}
+
+	if ((u = malloc (sizeof (*u))) == NULL)
+		return fail (o, ENOMEM);
+
+	u->absent = old == NULL;
+
+	if (u->absent && (old = entry_alloc (key, len, "", 0)) == NULL) {
+		free (u);
+		return fail (o, ENOMEM);
+	}
+
+	u->next  = o->undo;
+	u->entry = old;
+	o->undo  = u;
+	return 1;
+}
+
+static int mem_store (struct cmdb_backend *b, const void *key, size_t len,
+		      const void *data, size_t size)
+{
+	struct cmdb_memory *o = (void *) b;
+	struct entry *e, *old;
+
+	if (!o->writable)
+		return fail (o, EROFS);
+
+	if ((e = entry_alloc (key, len, data, size)) == NULL)
+		return fail (o, ENOMEM);
+
+	old = ht_lookup (&o->table, e);
+
+	if (!ht_insert (&o->table, e, 1)) {
+		free (e);
+		return fail (o, ENOMEM);
+	}
+
+	return keep (o, old, key, len);
+}
+
+static int mem_delete (struct cmdb_backend *b, const void *key, size_t len)
+{
+	struct cmdb_memory *o = (void *) b;
+	struct entry sample, *old;
+
+	if (!o->writable)
+		return fail (o, EROFS);
+
+	entry_sample (&sample, key, len);
+
+	if ((old = ht_lookup (&o->table, &sample)) == NULL)
+		return 1;
+
+	ht_remove (&o->table, old);
+	return keep (o, old, key, len);
+}
+
+static int mem_begin (struct cmdb_backend *b)
+{
+	struct cmdb_memory *o = (void *) b;
+
+	if (!o->writable)
+		return fail (o, EROFS);
+
+	o->started = 1;
+	return 1;
+}
+
+static int mem_commit (struct cmdb_backend *b, int sync)
+{
+	struct cmdb_memory *o = (void *) b;
+
+	undo_clean (o);
+	o->started = 0;
+	return 1;
+}
+
+static void mem_cancel (struct cmdb_backend *b)
+{
+	struct cmdb_memory *o = (void *) b;
+	struct undo *u;
+	struct entry *e;
+
+	while ((u = o->undo) != NULL) {
+		o->undo = u->next;
+
+		if ((e = ht_lookup (&o->table, u->entry)) != NULL) {
+			ht_remove (&o->table, e);
+			free (e);
+		}
+
+		/* table never shrinks: earlier state fits without resize */
+		if (u->absent)
+			free (u->entry);
+		else
+			ht_insert (&o->table, u->entry, 0);
+
+		free (u);
+	}
+
+	o->started = 0;
+}
+
+static int mem_iterate (struct cmdb_backend *b, cmdb_backend_visitor *fn,
+			void *cookie)
+{
+	struct cmdb_memory *o = (void *) b;
+	const struct entry *e;
+	size_t i;
+
+	for (i = 0; i < o->table.size; ++i)
+		if ((e = o->table.table[i]) != NULL &&
+		    !fn (e->key, e->len, e->data, e->size, cookie))
+			return 0;
+
+	return 1;
+}
+
+/* callers serialized by storage already */
+static int mem_lock_read (struct cmdb_backend *b)
+{
+	return 1;
+}
+
+static void mem_unlock_read (struct cmdb_backend *b)
+{
+}
+
+const struct cmdb_backend_type cmdb_memory_type = {
+	.open		= mem_open,
+	.close		= mem_close,
+	.error		= mem_error,
+	.same		= mem_same,
+	.fetch		= mem_fetch,
+	.store		= mem_store,
+	.delete		= mem_delete,
+	.begin		= mem_begin,
+	.commit		= mem_commit,
+	.cancel		= mem_cancel,
+	.iterate	= mem_iterate,
+	.lock_read	= mem_lock_read,
+	.unlock_read	= mem_unlock_read,
+};
@@ -48,7 +48,7 @@ static int resize (struct cmdb_path *o, size_t size)
 	return 1;
 }
 
-int cmdb_path_copy (struct cmdb_path *o, struct cmdb_path *from)
+int cmdb_path_copy (struct cmdb_path *o, const struct cmdb_path *from)
 {
 	size_t size = from->len + 1;
 
@@ -110,7 +110,7 @@ int cmdb_path_set (struct cmdb_path *o, const char *name)
 	if (iscntrl (name[0]))
 		type = name[0], ++name;
 
-	if ((len = append (o, type, name)) == o->size) {
+	if ((len = append (o, type, name)) >= o->size) {
 		if (!resize (o, len + 1))
 			return 0;
 
@@ -20,7 +20,7 @@ void cmdb_path_init (struct cmdb_path *o);
 void cmdb_path_fini (struct cmdb_path *o);
 
 void cmdb_path_reset (struct cmdb_path *o);
-int cmdb_path_copy (struct cmdb_path *o, struct cmdb_path *from);
+int cmdb_path_copy (struct cmdb_path *o, const struct cmdb_path *from);
 
 int cmdb_path_push (struct cmdb_path *o, const char *name);
 const char *cmdb_path_pop (struct cmdb_path *o);
@@ -0,0 +1,425 @@
+/*
+ * Configuration Management Database Snapshot Backend
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cmdb-backend.h"
+
+/*
+ * Snapshot is read-only image of database mapped into memory: header,
+ * index of records sorted by key, then keys and data. Numbers stored in
+ * host byte order, snapshot of other byte order rejected.
+ */
+#define SNAPSHOT_MAGIC	"cmdbsnap"
+#define SNAPSHOT_ORDER	0x01020304
+
+struct header {
+	char magic[8];
+	uint32_t order;
+	uint32_t count;
+};
+
+struct slot {
+	uint32_t key, len;    /* key offset and length */
+	uint32_t data, size;  /* data offset and size */
+};
+
+static int header_ok (const struct header *h)
+{
+	return memcmp (h->magic, SNAPSHOT_MAGIC, sizeof (h->magic)) == 0 &&
+	       h->order == SNAPSHOT_ORDER;
+}
+
+int cmdb_snapshot_probe (const char *path)
+{
+	struct header h;
+	int fd, ok;
+
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return 0;
+
+	ok = read (fd, &h, sizeof (h)) == sizeof (h) && header_ok (&h);
+	close (fd);
+	return ok;
+}
+
+struct cmdb_snapshot {
+	struct cmdb_backend backend;
+	const char *base;
+	size_t size, count;
+	const struct slot *slot;
+	dev_t dev;  /* identity of snapshot file */
+	ino_t ino;
+	int error;
+};
+
+static int in_bounds (size_t size, uint32_t offset, uint32_t len)
+{
+	return offset <= size && len <= size - offset;
+}
+
+/* index checked once at open: lookups trust it then */
+static int index_ok (const struct cmdb_snapshot *o)
+{
+	size_t i;
+
+	if (o->count > (o->size - sizeof (struct header)) / sizeof (o->slot[0]))
+		return 0;
+
+	for (i = 0; i < o->count; ++i)
+		if (!in_bounds (o->size, o->slot[i].key,  o->slot[i].len) ||
+		    !in_bounds (o->size, o->slot[i].data, o->slot[i].size))
+			return 0;
+
+	return 1;
+}
+
+static struct cmdb_backend *snap_open (const char *path, int writable)
+{
+	struct cmdb_snapshot *o;
+	const struct header *h;
+	struct stat st;
+	void *base;
+	int fd;
+
+	if (writable) {
+		errno = EROFS;
+		return NULL;
+	}
+
+	if ((o = malloc (sizeof (*o))) == NULL)
+		return NULL;
+
+	o->backend.type = &cmdb_snapshot_type;
+
+	if ((fd = open (path, O_RDONLY)) < 0)
+		goto no_file;
+
+	if (fstat (fd, &st) != 0)
+		goto no_map;
+
+	if (st.st_size < 0 || (size_t) st.st_size < sizeof (*h)) {
+		errno = EINVAL;
+		goto no_map;
+	}
+
+	base = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		goto no_map;
+
+	close (fd);
+
+	h = base;
+
+	o->base  = base;
+	o->size  = st.st_size;
+	o->count = h->count;
+	o->slot  = (const void *) (h + 1);
+	o->dev   = st.st_dev;
+	o->ino   = st.st_ino;
+	o->error = 0;
+
+	if (!header_ok (h) || !index_ok (o)) {
+		errno = EINVAL;
+		goto no_index;
+	}
+
+	return &o->backend;
+no_index:
+	munmap (base, st.st_size);
+	goto no_file;
+no_map:
+	close (fd);
+no_file:
+	free (o);
+	return NULL;
+}
+
+static int snap_close (struct cmdb_backend *b)
+{
+	struct cmdb_snapshot *o = (void *) b;
+
+	munmap ((void *) o->base, o->size);
+	free (o);
+	return 1;
+}
+
+static const char *snap_error (struct cmdb_backend *b)
+{
+	struct cmdb_snapshot *o = (void *) b;
+
+	return strerror (o->error);
+}
+
+static int snap_same (struct cmdb_backend *b, const char *path)
+{
+	struct cmdb_snapshot *o = (void *) b;
+	struct stat st;
+
+	return stat (path, &st) == 0 &&
+	       o->dev == st.st_dev && o->ino == st.st_ino;
+}
+
+static int key_cmp (const void *a, size_t alen, const void *b, size_t blen)
+{
+	int ret = memcmp (a, b, alen < blen ? alen : blen);
+
+	return ret != 0 ? ret : (alen > blen) - (alen < blen);
+}
+
+static int snap_fetch (struct cmdb_backend *b, const void *key, size_t len,
+		       cmdb_backend_parser *fn, void *cookie)
+{
+	struct cmdb_snapshot *o = (void *) b;
+	const struct slot *s;
+	size_t lo = 0, hi = o->count, mid;
+	int ret;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		s = o->slot + mid;
+
+		if ((ret = key_cmp (o->base + s->key, s->len, key, len)) == 0)
+			return fn (o->base + s->data, s->size, cookie) ? 1 : -1;
+
+		if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return 0;
+}
+
+static int snap_fail (struct cmdb_backend *b)
+{
+	struct cmdb_snapshot *o = (void *) b;
+
+	o->error = EROFS;
+	return 0;
+}
+
+static int snap_store (struct cmdb_backend *b, const void *key, size_t len,
+		       const void *data, size_t size)
+{
+	return snap_fail (b);
+}
+
+static int snap_delete (struct cmdb_backend *b, const void *key, size_t len)
+{
+	return snap_fail (b);
+}
+
+static int snap_commit (struct cmdb_backend *b, int sync)
+{
+	return snap_fail (b);
+}
+
+static void snap_cancel (struct cmdb_backend *b)
+{
+}
+
+static int snap_iterate (struct cmdb_backend *b, cmdb_backend_visitor *fn,
+			 void *cookie)
+{
+	struct cmdb_snapshot *o = (void *) b;
+	const struct slot *s;
+	size_t i;
+
+	for (i = 0, s = o->slot; i < o->count; ++i, ++s)
+		if (!fn (o->base + s->key, s->len, o->base + s->data, s->size,
+			 cookie))
+			return 0;
+
+	return 1;
+}
+
+/* image never changes */
+static int snap_lock_read (struct cmdb_backend *b)
+{
+	return 1;
+}
+
+static void snap_unlock_read (struct cmdb_backend *b)
+{
+}
+
+const struct cmdb_backend_type cmdb_snapshot_type = {
+	.mapped		= 1,
+	.open		= snap_open,
+	.close		= snap_close,
+	.error		= snap_error,
+	.same		= snap_same,
+	.fetch		= snap_fetch,
+	.store		= snap_store,
+	.delete		= snap_delete,
+	.begin		= snap_fail,
+	.commit		= snap_commit,
+	.cancel		= snap_cancel,
+	.iterate	= snap_iterate,
+	.lock_read	= snap_lock_read,
+	.unlock_read	= snap_unlock_read,
+};
+
+/* records collected from backend, key and data stored right after item */
+struct item {
+	size_t len, size;
+	const char *key, *data;
+};
+
+struct collect {
+	struct item **item;
+	size_t count, avail;
+	size_t bytes;  /* keys and data size */
+};
+
+static int collector (const void *key, size_t len, const void *data,
+		      size_t size, void *cookie)
+{
+	struct collect *c = cookie;
+	struct item **p, *o;
+	size_t avail;
+	char *q;
+
+	if (c->count == c->avail) {
+		avail = c->avail == 0 ? 64 : c->avail * 2;
+
+		if ((p = realloc (c->item, sizeof (p[0]) * avail)) == NULL)
+			return 0;
+
+		c->item  = p;
+		c->avail = avail;
+	}
+
+	if ((o = malloc (sizeof (*o) + len + size)) == NULL)
+		return 0;
+
+	q = (void *) (o + 1);
+
+	o->len  = len;
+	o->size = size;
+	o->key  = memcpy (q, key, len);
+	o->data = memcpy (q + len, data, size);
+
+	c->item[c->count++] = o;
+	c->bytes += len + size;
+	return 1;
+}
+
+static int item_cmp (const void *a, const void *b)
+{
+	const struct item *const *p = a;
+	const struct item *const *q = b;
+
+	return key_cmp ((*p)->key, (*p)->len, (*q)->key, (*q)->len);
+}
+
+static int write_snapshot (FILE *to, const struct collect *c)
+{
+	struct header h;
+	struct slot s;
+	size_t i, pos, n;
+
+	pos = sizeof (h) + sizeof (s) * c->count;
+
+	if (pos > UINT32_MAX || c->bytes > UINT32_MAX - pos) {
+		errno = EFBIG;
+		return 0;
+	}
+
+	memcpy (h.magic, SNAPSHOT_MAGIC, sizeof (h.magic));
+	h.order = SNAPSHOT_ORDER;
+	h.count = c->count;
+
+	if (fwrite (&h, sizeof (h), 1, to) != 1)
+		return 0;
+
+	for (i = 0; i < c->count; ++i) {
+		s.key  = pos;
+		s.len  = c->item[i]->len;
+		s.data = pos + s.len;
+		s.size = c->item[i]->size;
+		pos = s.data + s.size;
+
+		if (fwrite (&s, sizeof (s), 1, to) != 1)
+			return 0;
+	}
+
+	/* key and data are adjacent in item */
+	for (i = 0; i < c->count; ++i) {
+		n = c->item[i]->len + c->item[i]->size;
+
+		if (n > 0 && fwrite (c->item[i]->key, n, 1, to) != 1)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Snapshot written to temporary file next to target, then renamed over
+ * it: readers see either old snapshot or complete new one.
+ */
+int cmdb_snapshot_save (struct cmdb_backend *o, const char *path)
+{
+	struct collect c = { NULL, 0, 0, 0 };
+	char tmp[strlen (path) + 8];
+	FILE *to;
+	size_t i;
+	int fd, ok = 0;
+
+	/* consistent view: commits of other processes locked out */
+	if (!o->type->lock_read (o))
+		return 0;
+
+	ok = o->type->iterate (o, collector, &c);
+	o->type->unlock_read (o);
+
+	if (!ok)
+		goto no_collect;
+
+	ok = 0;
+
+	qsort (c.item, c.count, sizeof (c.item[0]), item_cmp);
+	snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+
+	if ((fd = mkstemp (tmp)) < 0)
+		goto no_collect;
+
+	if ((to = fdopen (fd, "wb")) == NULL) {
+		close (fd);
+		goto no_file;
+	}
+
+	ok = fchmod (fd, 0644) == 0 && write_snapshot (to, &c) &&
+	     fflush (to) == 0 && fsync (fd) == 0;
+
+	if (fclose (to) != 0)
+		ok = 0;
+
+	if (ok && rename (tmp, path) != 0)
+		ok = 0;
+no_file:
+	if (!ok)
+		unlink (tmp);
+no_collect:
+	for (i = 0; i < c.count; ++i)
+		free (c.item[i]);
+
+	free (c.item);
+	return ok;
+}
@@ -10,6 +10,8 @@
 #include <stdlib.h>
 
 #include <err.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "cmdb-storage.h"
 
@@ -34,9 +36,173 @@ static void show_sorted (struct cmdbs *o, const char *key)
 	free (list);
 }
 
+static void show_stats (struct cmdbs *o)
+{
+	struct cmdb_stats s;
+
+	cmdbs_stats (o, &s);
+	printf ("hits = %zu, negative = %zu, misses = %zu, memory = %zu, "
+		"evictions = %zu, refetches = %zu\n",
+		s.hits, s.negative, s.misses, s.memory,
+		s.evictions, s.refetches);
+}
+
+static size_t count (struct cmdbs *o, const char *key)
+{
+	const char *p;
+	size_t n = 0;
+
+	for (p = cmdbs_first (o, key); p != NULL; p = cmdbs_next (o, key, p))
+		++n;
+
+	return n;
+}
+
+static void flush_all (struct cmdbs *o)
+{
+	cmdbs_limit (o, 1);  /* evict everything unchanged */
+
+	if (!cmdbs_flush (o))
+		errx (1, "cannot flush: %s", cmdbs_error (o));
+
+	cmdbs_limit (o, 0);
+}
+
+/* large set stored in pages, small changes rewrite touched pages only */
+static void test_pages (struct cmdbs *o)
+{
+	char rule[32];
+	int i;
+
+	for (i = 0; i < 3000; ++i) {
+		snprintf (rule, sizeof (rule), "rule %d", i);
+
+		if (!cmdbs_store (o, "acl", rule))
+			errx (1, "cannot store: %s", cmdbs_error (o));
+	}
+
+	flush_all (o);
+	printf ("acl: %zu rules\n", count (o, "acl"));
+
+	if (!cmdbs_delete (o, "acl", "rule 7") ||
+	    !cmdbs_store (o, "acl", "rule 3000"))
+		errx (1, "cannot change: %s", cmdbs_error (o));
+
+	flush_all (o);
+	printf ("acl: %zu rules, rule 7 %sfound, rule 3000 %sfound\n",
+		count (o, "acl"),
+		cmdbs_exists (o, "acl", "rule 7")    ? "" : "not ",
+		cmdbs_exists (o, "acl", "rule 3000") ? "" : "not ");
+
+	for (i = 100; i < 3000; ++i) {
+		snprintf (rule, sizeof (rule), "rule %d", i);
+
+		if (!cmdbs_delete (o, "acl", rule))
+			errx (1, "cannot delete: %s", cmdbs_error (o));
+	}
+
+	flush_all (o);
+	printf ("acl: %zu rules\n", count (o, "acl"));
+
+	if (!cmdbs_delete (o, "acl", NULL))
+		errx (1, "cannot delete: %s", cmdbs_error (o));
+
+	flush_all (o);
+	printf ("acl: %zu rules\n", count (o, "acl"));
+}
+
+static void change_hostname (int fd)
+{
+	struct cmdbs *o;
+	char c;
+
+	if (read (fd, &c, 1) != 1)
+		_exit (1);
+
+	if ((o = cmdbs_open ("cmdbs-shared.db", "rw")) == NULL ||
+	    !cmdbs_delete (o, "hostname", NULL) ||
+	    !cmdbs_store (o, "hostname", "changed") || !cmdbs_flush (o))
+		_exit (1);
+
+	cmdbs_close (o);
+	_exit (0);
+}
+
+/* changes flushed by other process seen through cache */
+static void test_coherency (void)
+{
+	struct cmdbs *o;
+	const char *hostname, *domain;
+	size_t generation;
+	int fd[2], status;
+	pid_t pid;
+
+	if (pipe (fd) != 0 || (pid = fork ()) < 0)
+		err (1, "cannot start writer");
+
+	if (pid == 0)
+		change_hostname (fd[0]);
+
+	if ((o = cmdbs_open ("cmdbs-shared.db", "rw")) == NULL)
+		errx (1, "cannot open shared database");
+
+	if (!cmdbs_delete (o, "hostname", NULL) ||
+	    !cmdbs_store (o, "hostname", "original") ||
+	    !cmdbs_store (o, "domain", "example.org") || !cmdbs_flush (o))
+		errx (1, "cannot store: %s", cmdbs_error (o));
+
+	hostname = cmdbs_first (o, "hostname");
+	domain   = cmdbs_first (o, "domain");
+	printf ("shared: hostname = %s\n", hostname);
+	generation = cmdbs_generation (o);
+
+	if (write (fd[1], "", 1) != 1 || waitpid (pid, &status, 0) != pid ||
+	    !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+		errx (1, "writer failed");
+
+	printf ("shared: hostname = %s (was %s), domain %s\n",
+		cmdbs_first (o, "hostname"), hostname,
+		cmdbs_first (o, "domain") == domain ? "kept" : "reloaded");
+	printf ("shared: known nodes %s\n",
+		cmdbs_generation (o) != generation ? "dropped" : "kept");
+
+	if (!cmdbs_delete (o, "hostname", NULL) ||
+	    !cmdbs_delete (o, "domain", NULL) || !cmdbs_flush (o))
+		errx (1, "cannot delete: %s", cmdbs_error (o));
+
+	cmdbs_close (o);
+	close (fd[0]);
+	close (fd[1]);
+}
+
+/* readers never flush: cache trimmed on misses too */
+static void test_trim (struct cmdbs *o)
+{
+	struct cmdb_stats before, after;
+	char key[32];
+	int i;
+
+	cmdbs_stats (o, &before);
+	cmdbs_limit (o, 1);
+
+	for (i = 0; i < 10; ++i) {
+		snprintf (key, sizeof (key), "missing-%d", i);
+		count (o, key);
+	}
+
+	cmdbs_stats (o, &after);
+	cmdbs_limit (o, 0);
+
+	printf ("lookups %strimmed cache\n",
+		after.evictions > before.evictions ? "" : "not ");
+}
+
 int main (int argc, char *argv[])
 {
 	struct cmdbs *o;
+	int i;
+
+	test_coherency ();
 
 	if ((o = cmdbs_open ("cmdbs-test.db", "rwx")) == NULL)
 		errx (1, "cannot open database");
@@ -55,6 +221,24 @@ int main (int argc, char *argv[])
 	show_sorted (o, "address");
 	show (o, "hostname");
 
+	for (i = 0; i < 10; ++i)
+		if (cmdbs_exists (o, "description", NULL))
+			errx (1, "description should not exist");
+
+	show_stats (o);
+
+	cmdbs_limit (o, 1);  /* evict everything unchanged */
+
+	if (!cmdbs_flush (o))
+		errx (1, "cannot flush: %s", cmdbs_error (o));
+
+	show_sorted (o, "address");
+	show_stats (o);
+	cmdbs_limit (o, 0);
+
+	test_pages (o);
+	test_trim (o);
+
 	if (!cmdbs_delete (o, "address", "10.0.26.3/24"))
 		errx (1, "cannot delete: %s", cmdbs_error (o));
 
@@ -7,50 +7,83 @@
  */
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <tdb.h>
+#include <pthread.h>
 
+#include "cmdb-backend.h"
 #include "cmdb-cache.h"
+#include "cmdb-hash.h"
 #include "cmdb-storage.h"
 
-static int make_path (const char *path)
+/*
+ * Storage shared by sessions. Readers of cached records hold read lock,
+ * database access and cache changes need write lock. Writers also hold
+ * recursive write mutex to serialize compound changes. Database version
+ * checks serialized by check mutex.
+ */
+struct cmdbs {
+	struct cmdbc *cache;
+	struct cmdb_backend *db;
+	struct cmdb_stats stats;
+	pthread_rwlock_t lock;
+	pthread_mutex_t write, check;
+	size_t refs, generation;
+	size_t seen;         /* database version cache matches */
+	struct cmdbs *next;  /* next open storage */
+	int writable;
+};
+
+static int init_locks (struct cmdbs *o)
 {
-	size_t size = strlen (path) + 1;
-	char line[size], *p;
+	pthread_mutexattr_t a;
+	int ok;
 
-	if (path == NULL || path[0] == '\0') {
-		errno = EINVAL;
+	if (pthread_mutexattr_init (&a) != 0)
 		return 0;
-	}
 
-	strncpy (line, path, size);
+	ok = pthread_mutexattr_settype (&a, PTHREAD_MUTEX_RECURSIVE) == 0 &&
+	     pthread_mutex_init (&o->write, &a) == 0;
 
-	for (p = line + 1; *p != '\0'; ++p)
-		if (*p == '/') {
-			*p = '\0';
+	pthread_mutexattr_destroy (&a);
 
-			if (mkdir (line, 0777) != 0 && errno != EEXIST)
-				return 0;
+	if (!ok)
+		return 0;
 
-			*p = '/';
-		}
+	if (pthread_rwlock_init (&o->lock, NULL) != 0)
+		goto no_lock;
+
+	if (pthread_mutex_init (&o->check, NULL) != 0)
+		goto no_check;
 
 	return 1;
+no_check:
+	pthread_rwlock_destroy (&o->lock);
+no_lock:
+	pthread_mutex_destroy (&o->write);
+	return 0;
 }
 
-struct cmdbs {
-	struct cmdbc *cache;
-	TDB_CONTEXT *db;
-};
+static void fini_locks (struct cmdbs *o)
+{
+	pthread_mutex_destroy (&o->check);
+	pthread_rwlock_destroy (&o->lock);
+	pthread_mutex_destroy (&o->write);
+}
 
-struct cmdbs *cmdbs_open (const char *path, const char *mode)
+static size_t version (struct cmdbs *o)
+{
+	return o->db->type->version == NULL ? 0 :
+	       o->db->type->version (o->db);
+}
+
+static struct cmdbs *
+cmdbs_alloc (const struct cmdb_backend_type *type, const char *path,
+	     int writable)
 {
 	struct cmdbs *o;
-	int flags = O_RDONLY;
 
 	if ((o = malloc (sizeof (*o))) == NULL)
 		return NULL;
@@ -58,25 +91,108 @@ struct cmdbs *cmdbs_open (const char *path, const char *mode)
 	if ((o->cache = cmdbc_alloc ()) == NULL)
 		goto no_cache;
 
-	for (; *mode != '\0'; ++mode)
-		if (*mode == 'w') {
-			flags = O_RDWR | O_CREAT;
+	cmdbc_set_hash (o->cache, cmdb_hash_fast);
 
-			if (!make_path (path))
-				goto no_db;
-		}
+	if (!init_locks (o))
+		goto no_locks;
 
-	if ((o->db = tdb_open (path, 0, 0, flags, 0666)) == NULL)
+	memset (&o->stats, 0, sizeof (o->stats));
+	o->refs = 1;
+	o->generation = 0;
+	o->writable = writable;
+
+	if ((o->db = type->open (path, writable)) == NULL)
 		goto no_db;
 
+	o->seen = version (o);
 	return o;
 no_db:
+	fini_locks (o);
+no_locks:
 	cmdbc_free (o->cache);
 no_cache:
 	free (o);
 	return NULL;
 }
 
+/*
+ * Storages opened in process, database can be opened only once by
+ * process: handles to the same database share storage and cache.
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cmdbs *registry;
+
+static struct cmdbs *
+registry_lookup (const struct cmdb_backend_type *type, const char *path)
+{
+	struct cmdbs *o;
+
+	for (o = registry; o != NULL; o = o->next)
+		if (o->db->type == type && type->same (o->db, path))
+			return o;
+
+	return NULL;
+}
+
+static void registry_remove (struct cmdbs *o)
+{
+	struct cmdbs **p;
+
+	for (p = &registry; *p != NULL; p = &(*p)->next)
+		if (*p == o) {
+			*p = o->next;
+			return;
+		}
+}
+
+/*
+ * Mode letters: w -- writable, m -- in-memory database, j -- journal.
+ * Snapshot file opened read-only in place of database.
+ */
+struct cmdbs *cmdbs_open (const char *path, const char *mode)
+{
+	const struct cmdb_backend_type *type = &cmdb_tdb_type;
+	struct cmdbs *o;
+	int writable = 0;
+
+	for (; *mode != '\0'; ++mode)
+		if (*mode == 'w')
+			writable = 1;
+		else if (*mode == 'm')
+			type = &cmdb_memory_type;
+		else if (*mode == 'j')
+			type = &cmdb_journal_type;
+
+	if (type == &cmdb_tdb_type && !writable && cmdb_snapshot_probe (path))
+		type = &cmdb_snapshot_type;
+
+	pthread_mutex_lock (&registry_lock);
+
+	if ((o = registry_lookup (type, path)) != NULL) {
+		/* read-only database cannot be shared for writing */
+		if (writable && !o->writable) {
+			errno = EBUSY;
+			o = NULL;
+		}
+		else
+			cmdbs_get (o);
+	}
+	else if ((o = cmdbs_alloc (type, path, writable)) != NULL) {
+		o->next  = registry;
+		registry = o;
+	}
+
+	pthread_mutex_unlock (&registry_lock);
+	return o;
+}
+
+struct cmdbs *cmdbs_get (struct cmdbs *o)
+{
+	__atomic_add_fetch (&o->refs, 1, __ATOMIC_RELAXED);
+	return o;
+}
+
+/* last user flushes changes and closes database */
 int cmdbs_close (struct cmdbs *o)
 {
 	int ret = 1;
@@ -84,12 +200,23 @@ int cmdbs_close (struct cmdbs *o)
 	if (o == NULL)
 		return ret;
 
+	pthread_mutex_lock (&registry_lock);
+
+	if (__atomic_sub_fetch (&o->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+		pthread_mutex_unlock (&registry_lock);
+		return ret;
+	}
+
+	registry_remove (o);
+	pthread_mutex_unlock (&registry_lock);
+
 	if (!cmdbs_flush (o))
 		ret = 0;
 
-	if (tdb_close (o->db) != 0)
+	if (!o->db->type->close (o->db))
 		ret = 0;
 
+	fini_locks (o);
 	cmdbc_free (o->cache);
 	free (o);
 	return ret;
@@ -97,99 +224,720 @@ int cmdbs_close (struct cmdbs *o)
 
 const char *cmdbs_error (struct cmdbs *o)
 {
-	return tdb_errorstr (o->db);
+	return o->db->type->error (o->db);
 }
 
-int cmdbs_exists (struct cmdbs *o, const char *key, const char *value)
+/*
+ * Large sets split into power of two number of pages stored at keys
+ * "<key>\f<index>". Main key holds directory "\f<count>" then: it has
+ * no terminating NUL, thus it never looks like single record set.
+ */
+#define PAGE_SIZE	4096
+
+static size_t dir_parse (const void *data, size_t size)
 {
-	if (cmdbs_first (o, key) == NULL)
+	const char *p = data;
+	size_t i, n = 0;
+
+	if (size < 2 || p[0] != '\f')
 		return 0;
 
-	return cmdbc_exists (o->cache, key, value);
+	for (i = 1; i < size; ++i) {
+		if (p[i] < '0' || p[i] > '9')
+			return 0;
+
+		n = n * 10 + (p[i] - '0');
+	}
+
+	return n;
 }
 
-static int cmdbs_fetch (struct cmdbs *o, const char *key)
+/* pick page count for set of given size, keep current one if it fits */
+static size_t layout (size_t bytes, size_t pages)
 {
-	TDB_DATA k, v;
-	int ret;
+	size_t n;
 
-	k.dptr = (void *) key;
-	k.dsize = strlen (key) + 1;
-	v = tdb_fetch (o->db, k);
+	if (pages > 0 && bytes <= pages * PAGE_SIZE &&
+	    bytes * 8 >= pages * PAGE_SIZE)
+		return pages;
 
-	if (v.dptr == NULL)
+	if (bytes <= (pages > 0 ? PAGE_SIZE / 2 : PAGE_SIZE))
 		return 0;
 
-	ret = cmdbc_import (o->cache, key, v.dptr, v.dsize);
-	free (v.dptr);
+	for (n = 1; n * PAGE_SIZE / 2 < bytes; n *= 2) {}
+
+	return n;
+}
+
+/* returns page key length including terminating NUL */
+static size_t page_key (char *buf, size_t size, const char *key, size_t i)
+{
+	return snprintf (buf, size, "%s\f%zu", key, i) + 1;
+}
+
+#define PAGE_KEY_SIZE(key)	(strlen (key) + 24)
+
+struct fetch {
+	struct cmdbc *cache;
+	const struct cmdbc_key *key;
+	size_t pages;
+	int mapped, same;
+};
+
+/* values of mapped backends referenced in place, no copy */
+static int import (struct fetch *c, const void *data, size_t size)
+{
+	return c->mapped ? cmdbc_import_mapped (c->cache, c->key, data, size) :
+			   cmdbc_import_key    (c->cache, c->key, data, size);
+}
+
+static int parser (const void *data, size_t size, void *cookie)
+{
+	struct fetch *c = cookie;
+
+	if ((c->pages = dir_parse (data, size)) > 0)
+		size = 0;
+
+	return import (c, data, size);
+}
+
+static int page_parser (const void *data, size_t size, void *cookie)
+{
+	return import (cookie, data, size);
+}
+
+static int fetch_pages (struct cmdbs *o, struct fetch *c)
+{
+	char buf[PAGE_KEY_SIZE (c->key->name)];
+	size_t len, i;
+
+	for (i = 0; i < c->pages; ++i) {
+		len = page_key (buf, sizeof (buf), c->key->name, i);
+
+		if (o->db->type->fetch (o->db, buf, len, page_parser, c) < 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int same_parser (const void *data, size_t size, void *cookie)
+{
+	struct fetch *c = cookie;
+
+	c->same = dir_parse (data, size) == 0 &&
+		  cmdbc_equal_key (c->cache, c->key, data, size);
+	return 1;
+}
+
+/*
+ * Stale record compared with stored one: unchanged record renewed in
+ * place. Changed record retired to be fetched again, values returned
+ * from it stay valid until database changed again or flush. Record walked by cursor kept stale
+ * until cursor closed. Returns 1 if record kept, 0 if dropped, -1 on
+ * failure.
+ */
+static int revalidate (struct cmdbs *o, const struct cmdbc_key *key)
+{
+	struct fetch c = { o->cache, key, 0, 0, 0 };
+	int found;
+
+	found = o->db->type->fetch (o->db, key->name, key->len + 1,
+				    same_parser, &c);
+	if (found < 0)
+		return -1;
+
+	if (found ? c.same : cmdbc_equal_key (o->cache, key, "", 0)) {
+		cmdbc_renew (o->cache, key);
+		return 1;
+	}
+
+	cmdbc_retire (o->cache, key);
+	return cmdbc_exists_key (o->cache, key, NULL);
+}
+
+/*
+ * Records parsed in place without intermediate copy. Absent keys
+ * imported as empty records: repeated lookups of missing attributes
+ * and nodes served from cache without database access. Partially
+ * fetched records dropped. Cache trimmed to the limit before miss
+ * loaded: readers never flush.
+ */
+static int cmdbs_fetch (struct cmdbs *o, const struct cmdbc_key *key)
+{
+	struct fetch c = { o->cache, key, 0, o->db->type->mapped, 0 };
+	int found;
+
+	++o->stats.misses;
+	o->stats.evictions += cmdbc_trim (o->cache);
+
+	if (cmdbc_exists_key (o->cache, key, NULL) &&
+	    (found = revalidate (o, key)) != 0)
+		return found > 0;
+
+	if (cmdbc_evicted (o->cache, key))
+		++o->stats.refetches;
+
+	found = o->db->type->fetch (o->db, key->name, key->len + 1, parser, &c);
+
+	if (found < 0 ||
+	    (found == 0 && !cmdbc_import_key (o->cache, key, "", 0)))
+		goto no_fetch;
+
+	if (!fetch_pages (o, &c) || !cmdbc_set_pages (o->cache, key, c.pages))
+		goto no_fetch;
+
+	return 1;
+no_fetch:
+	cmdbc_forget (o->cache, key);
+	return 0;
+}
+
+/*
+ * Whether database changed by other process since cache checked
+ * against it. Readers check it under read lock: check skipped if other
+ * thread does it or flush writes database meanwhile.
+ */
+static int changed (struct cmdbs *o)
+{
+	int ret;
+
+	if (o->db->type->version == NULL ||
+	    pthread_mutex_trylock (&o->check) != 0)
+		return 0;
+
+	ret = version (o) != o->seen;
+	pthread_mutex_unlock (&o->check);
 	return ret;
 }
 
-const char *cmdbs_first (struct cmdbs *o, const char *key)
+/*
+ * Cached records become stale, under write lock only. Values of records
+ * retired on previous change freed now, nodes known to exist may be
+ * deleted by other process.
+ */
+static void refresh (struct cmdbs *o)
 {
-	if (cmdbc_exists (o->cache, key, NULL))
-		return cmdbc_first (o->cache, key);
+	size_t v = version (o);
 
-	if (!cmdbs_fetch (o, key))
-		return NULL;
+	if (v != o->seen) {
+		o->seen = v;
+		cmdbc_release (o->cache);
+		cmdbc_expire (o->cache);
+		__atomic_add_fetch (&o->generation, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Take read lock if record is in cache and valid already, write lock
+ * otherwise: it should be fetched then. Returns whether read lock
+ * taken. Records stay valid under read lock: they expire, fetched and
+ * dropped under write lock only.
+ */
+static int lock (struct cmdbs *o, const struct cmdbc_key *k)
+{
+	pthread_rwlock_rdlock (&o->lock);
+
+	if (!changed (o) && cmdbc_fresh_key (o->cache, k))
+		return 1;
+
+	pthread_rwlock_unlock (&o->lock);
+	pthread_rwlock_wrlock (&o->lock);
+	refresh (o);
+	return 0;
+}
+
+static void unlock (struct cmdbs *o)
+{
+	pthread_rwlock_unlock (&o->lock);
+}
+
+static void write_begin (struct cmdbs *o)
+{
+	pthread_mutex_lock (&o->write);
+	pthread_rwlock_wrlock (&o->lock);
+	refresh (o);
+}
+
+static void write_end (struct cmdbs *o)
+{
+	pthread_rwlock_unlock (&o->lock);
+	pthread_mutex_unlock (&o->write);
+}
+
+/* make sure record is in cache */
+static int cmdbs_load (struct cmdbs *o, const struct cmdbc_key *k)
+{
+	return cmdbc_fresh_key (o->cache, k) || cmdbs_fetch (o, k);
+}
+
+int cmdbs_exists (struct cmdbs *o, const char *key, const char *value)
+{
+	struct cmdbc_key k;
+
+	cmdbc_key_init (o->cache, &k, key);
+	return cmdbs_exists_key (o, &k, value);
+}
+
+const char *cmdbs_first (struct cmdbs *o, const char *key)
+{
+	struct cmdbc_key k;
 
-	return cmdbc_first (o->cache, key);
+	cmdbc_key_init (o->cache, &k, key);
+	return cmdbs_first_key (o, &k);
 }
 
 const char *cmdbs_next (struct cmdbs *o, const char *key, const char *value)
 {
-	return cmdbc_next (o->cache, key, value);
+	struct cmdbc_key k;
+
+	cmdbc_key_init (o->cache, &k, key);
+	return cmdbs_next_key (o, &k, value);
 }
 
 const char **cmdbs_list (struct cmdbs *o, const char *key)
 {
-	if (cmdbs_first (o, key) == NULL)
-		return NULL;
+	struct cmdbc_key k;
+
+	cmdbc_key_init (o->cache, &k, key);
+	return cmdbs_list_key (o, &k);
+}
+
+/* record fetched if write lock taken and other thread did not fetch it */
+static const char *first (struct cmdbs *o, const struct cmdbc_key *k,
+			  int shared)
+{
+	const char *p;
+
+	if (!shared && !cmdbc_fresh_key (o->cache, k)) {
+		if (!cmdbs_fetch (o, k))
+			return NULL;
+
+		return cmdbc_first_key (o->cache, k);
+	}
+
+	if ((p = cmdbc_first_key (o->cache, k)) != NULL)
+		__atomic_add_fetch (&o->stats.hits, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch (&o->stats.negative, 1, __ATOMIC_RELAXED);
+
+	return p;
+}
+
+int cmdbs_exists_key (struct cmdbs *o, const struct cmdbc_key *k,
+		      const char *value)
+{
+	int shared, ret;
+
+	shared = lock (o, k);
+	ret = first (o, k, shared) != NULL &&
+	      cmdbc_exists_key (o->cache, k, value);
+	unlock (o);
+	return ret;
+}
+
+const char *cmdbs_first_key (struct cmdbs *o, const struct cmdbc_key *k)
+{
+	const char *p;
+	int shared;
+
+	shared = lock (o, k);
+	p = first (o, k, shared);
+	unlock (o);
+	return p;
+}
+
+/* walk continues on fresh record: value passed found by comparison */
+const char *cmdbs_next_key (struct cmdbs *o, const struct cmdbc_key *k,
+			    const char *value)
+{
+	const char *p = NULL;
+
+	if (lock (o, k) || cmdbs_load (o, k))
+		p = cmdbc_next_key (o->cache, k, value);
+
+	unlock (o);
+	return p;
+}
+
+const char **cmdbs_list_key (struct cmdbs *o, const struct cmdbc_key *k)
+{
+	const char **list = NULL;
+	int shared;
+
+	shared = lock (o, k);
+
+	if (first (o, k, shared) != NULL)
+		list = cmdbc_list_key (o->cache, k);
+
+	unlock (o);
+	return list;
+}
+
+int cmdbs_cursor_init (struct cmdbs *o, struct cmdbc_cursor *c,
+		       const char *key)
+{
+	struct cmdbc_key k;
+	int ok;
+
+	cmdbc_key_init (o->cache, &k, key);
+
+	ok = (lock (o, &k) || cmdbs_load (o, &k)) &&
+	     cmdbc_cursor_init (o->cache, c, key);
+	unlock (o);
+	return ok;
+}
+
+void cmdbs_cursor_fini (struct cmdbs *o, struct cmdbc_cursor *c)
+{
+	pthread_rwlock_rdlock (&o->lock);
+	cmdbc_cursor_fini (c);
+	unlock (o);
+}
+
+const char *cmdbs_cursor_next (struct cmdbs *o, struct cmdbc_cursor *c)
+{
+	const char *p;
+
+	pthread_rwlock_rdlock (&o->lock);
+	p = cmdbc_cursor_next (c);
+	unlock (o);
+	return p;
+}
+
+/* writers locked out as well: no transactions under database lock */
+int cmdbs_lock_read (struct cmdbs *o)
+{
+	int ok;
+
+	write_begin (o);
+	ok = o->db->type->lock_read (o->db);
+	pthread_rwlock_unlock (&o->lock);
+
+	if (!ok)
+		pthread_mutex_unlock (&o->write);
+
+	return ok;
+}
 
-	return cmdbc_list (o->cache, key);
+void cmdbs_unlock_read (struct cmdbs *o)
+{
+	pthread_rwlock_wrlock (&o->lock);
+	o->db->type->unlock_read (o->db);
+	write_end (o);
+}
+
+void cmdbs_write_begin (struct cmdbs *o)
+{
+	pthread_mutex_lock (&o->write);
+}
+
+void cmdbs_write_end (struct cmdbs *o)
+{
+	pthread_mutex_unlock (&o->write);
+}
+
+size_t cmdbs_generation (struct cmdbs *o)
+{
+	return __atomic_load_n (&o->generation, __ATOMIC_ACQUIRE);
+}
+
+void cmdbs_key_init (struct cmdbs *o, struct cmdbc_key *k, const char *key)
+{
+	cmdbc_key_init (o->cache, k, key);
+}
+
+void cmdbs_limit (struct cmdbs *o, size_t limit)
+{
+	write_begin (o);
+	cmdbc_limit (o->cache, limit);
+	write_end (o);
+}
+
+int cmdbs_limited (struct cmdbs *o)
+{
+	int ret;
+
+	pthread_rwlock_rdlock (&o->lock);
+	ret = cmdbc_limited (o->cache);
+	unlock (o);
+	return ret;
+}
+
+void cmdbs_stats (struct cmdbs *o, struct cmdb_stats *s)
+{
+	pthread_rwlock_wrlock (&o->lock);
+	*s = o->stats;
+	s->memory = cmdbc_usage (o->cache);
+	unlock (o);
 }
 
 int cmdbs_store (struct cmdbs *o, const char *key, const char *value)
 {
-	if (!cmdbc_exists (o->cache, key, NULL))
-		cmdbs_fetch (o, key);
+	const char *list[] = { value, NULL };
 
-	return cmdbc_store (o->cache, key, value);
+	return cmdbs_store_list (o, key, list);
+}
+
+int cmdbs_store_list (struct cmdbs *o, const char *key, const char **list)
+{
+	struct cmdbc_key k;
+
+	cmdbc_key_init (o->cache, &k, key);
+	return cmdbs_store_list_key (o, &k, list);
+}
+
+/*
+ * Stored values merged with ones from database: store fails if they
+ * cannot be fetched, otherwise flush would lose them.
+ */
+int cmdbs_store_list_key (struct cmdbs *o, const struct cmdbc_key *k,
+			  const char **list)
+{
+	int ok;
+
+	write_begin (o);
+	ok = cmdbs_load (o, k) && cmdbc_store_list_key (o->cache, k, list);
+	write_end (o);
+	return ok;
 }
 
 int cmdbs_delete (struct cmdbs *o, const char *key, const char *value)
 {
-	if (!cmdbc_exists (o->cache, key, NULL))
-		cmdbs_fetch (o, key);
+	struct cmdbc_key k;
+	int ok;
+
+	cmdbc_key_init (o->cache, &k, key);
+
+	write_begin (o);
+	ok = (value == NULL || cmdbs_load (o, &k)) &&
+	     cmdbc_delete (o->cache, key, value);
+
+	__atomic_add_fetch (&o->generation, 1, __ATOMIC_RELEASE);
+	write_end (o);
+	return ok;
+}
+
+int cmdbs_copy (struct cmdbs *o, const char *from, const char *to)
+{
+	struct cmdbc_key k;
+	int ok;
+
+	cmdbc_key_init (o->cache, &k, from);
+
+	write_begin (o);
+	ok = cmdbs_load (o, &k) && cmdbc_copy (o->cache, from, to);
+	write_end (o);
+	return ok;
+}
+
+struct flush {
+	struct cmdbs *o;
+	int started;
+	int stale;    /* database changed before transaction */
+	void *buf;    /* scratch buffer for serialized records */
+	size_t size;
+};
+
+/* store data, empty data means absent record */
+static int put (struct cmdbs *o, const char *key, size_t len,
+		const void *data, size_t size)
+{
+	if (size == 0)
+		return o->db->type->delete (o->db, key, len);
+
+	return o->db->type->store (o->db, key, len, data, size);
+}
 
-	cmdbc_delete (o->cache, key, value);
+static int write_record (struct flush *c, const char *key, size_t len)
+{
+	struct cmdbc *cache = c->o->cache;
+	size_t size;
+	void *buf;
+
+	if ((size = cmdbc_export (cache, key, c->buf, c->size)) > c->size) {
+		if ((buf = realloc (c->buf, size)) == NULL)
+			return 0;
+
+		c->buf  = buf;
+		c->size = size;
+
+		cmdbc_export (cache, key, c->buf, c->size);
+	}
+
+	/* drop empty nodes, they may be not stored yet */
+	return put (c->o, key, len, c->buf, size);
+}
+
+static int page_writer (struct cmdbc *cache, const char *key, size_t i,
+			const void *data, size_t size, void *cookie)
+{
+	struct flush *c = cookie;
+	char buf[PAGE_KEY_SIZE (key)];
+	size_t len = page_key (buf, sizeof (buf), key, i);
+
+	return put (c->o, buf, len, data, size);
+}
+
+static int dir_parser (const void *data, size_t size, void *cookie)
+{
+	size_t *pages = cookie;
+
+	*pages = dir_parse (data, size);
 	return 1;
 }
 
+/* page count of record stored, for records changed without fetch */
+static size_t stored_pages (struct cmdbs *o, const char *key, size_t len)
+{
+	size_t pages = 0;
+
+	o->db->type->fetch (o->db, key, len, dir_parser, &pages);
+	return pages;
+}
+
+/*
+ * Paged set writes its changed pages only, page count changes rewrite
+ * all of them.
+ */
 static int writer (struct cmdbc *cache, const char *key, void *cookie)
 {
-	struct cmdbs *o = cookie;
-	TDB_DATA k, v;
+	struct flush *c = cookie;
+	struct cmdbs *o = c->o;
+	char buf[PAGE_KEY_SIZE (key)], dir[24];
+	size_t len = strlen (key) + 1, old, pages, i;
+	int ok;
+
+	/* start transaction lazily: nothing to do if nothing changed */
+	if (!c->started) {
+		if (!o->db->type->begin (o->db))
+			return 0;
+
+		c->started = 1;
+		c->stale = version (o) != o->seen;
+	}
+
+	if ((old = cmdbc_pages (cache, key)) == CMDBC_PAGES_UNKNOWN)
+		old = stored_pages (o, key, len);
+
+	pages = layout (cmdbc_export (cache, key, NULL, 0), old);
+	cmdbc_set_layout (cache, key, pages);
+
+	if (pages == 0)
+		ok = write_record (c, key, len);
+	else
+		ok = cmdbc_export_pages (cache, key, pages, page_writer, c) &&
+		     (pages == old ||
+		      put (o, key, len, dir,
+			   snprintf (dir, sizeof (dir), "\f%zu", pages)));
+
+	/* drop pages left from previous layout */
+	for (i = pages; ok && i < old; ++i)
+		ok = put (o, buf, page_key (buf, sizeof (buf), key, i),
+			  NULL, 0);
+
+	return ok;
+}
+
+/*
+ * All changes written in one transaction: either all of them reach the
+ * database or none. Changed records stay dirty in cache on failure.
+ */
+static int flush (struct cmdbs *o, int sync)
+{
+	struct flush c = { o, 0, 0, NULL, 0 };
 	int ret;
 
-	k.dptr  = (void *) key;
-	k.dsize = strlen (key) + 1;
+	/* other writers locked out, readers may use cache meanwhile */
+	pthread_mutex_lock (&o->write);
+	pthread_rwlock_rdlock (&o->lock);
+	pthread_mutex_lock (&o->check);
 
-	if ((v.dsize = cmdbc_export (cache, key, NULL, 0)) == 0)
-		/* drop empty nodes */
-		return tdb_delete (o->db, k) == 0;
+	ret = cmdbc_scan (o->cache, writer, &c);
+	free (c.buf);
 
-	if ((v.dptr = malloc (v.dsize)) == NULL)
-		return 0;
+	if (!ret) {
+		if (c.started)
+			o->db->type->cancel (o->db);
+	}
+	else if (c.started && (ret = o->db->type->commit (o->db, sync)) &&
+		 !c.stale)
+		o->seen = version (o);  /* own changes are in cache already */
+
+	pthread_mutex_unlock (&o->check);
+	unlock (o);
+
+	if (ret) {
+		pthread_rwlock_wrlock (&o->lock);
 
-	cmdbc_export (cache, key, v.dptr, v.dsize);
+		if (c.started)
+			cmdbc_clean (o->cache);
 
-	ret = tdb_store (o->db, k, v, TDB_REPLACE) == 0;
-	free (v.dptr);
+		o->stats.evictions += cmdbc_trim (o->cache);
+		cmdbc_release (o->cache);
+		unlock (o);
+	}
+
+	pthread_mutex_unlock (&o->write);
 	return ret;
 }
 
 int cmdbs_flush (struct cmdbs *o)
 {
-	return cmdbc_flush (o->cache, writer, o);
+	return flush (o, 1);
+}
+
+int cmdbs_flush_nosync (struct cmdbs *o)
+{
+	return flush (o, 0);
+}
+
+/* records stay the same: cached ones remain valid */
+int cmdbs_compact (struct cmdbs *o, struct cmdb_compact *s)
+{
+	int ok = 0;
+
+	memset (s, 0, sizeof (*s));
+	pthread_mutex_lock (&o->write);
+
+	if (o->db->type->compact == NULL)
+		errno = ENOTSUP;
+	else if (flush (o, 1)) {
+		pthread_rwlock_wrlock (&o->lock);
+		refresh (o);
+
+		/* new database starts its own version count */
+		if ((ok = o->db->type->compact (o->db, s)))
+			o->seen = version (o);
+
+		unlock (o);
+	}
+
+	pthread_mutex_unlock (&o->write);
+	return ok;
+}
+
+/*
+ * Changes flushed first: snapshot matches what other processes see.
+ * Database walked under read lock as in flush: readers may use cache
+ * meanwhile, but no one fetches from database or checks its version.
+ */
+int cmdbs_snapshot (struct cmdbs *o, const char *path)
+{
+	int ok;
+
+	pthread_mutex_lock (&o->write);
+
+	if ((ok = flush (o, 1))) {
+		pthread_rwlock_rdlock (&o->lock);
+		pthread_mutex_lock (&o->check);
+
+		ok = cmdb_snapshot_save (o->db, path);
+
+		pthread_mutex_unlock (&o->check);
+		unlock (o);
+	}
+
+	pthread_mutex_unlock (&o->write);
+	return ok;
 }
@@ -11,7 +11,12 @@
 
 #include <stddef.h>
 
+#include "cmdb.h"
+#include "cmdb-cache.h"
+
 struct cmdbs *cmdbs_open (const char *path, const char *mode);
+/* get another reference to storage, closed by last cmdbs_close */
+struct cmdbs *cmdbs_get (struct cmdbs *o);
 int cmdbs_close (struct cmdbs *o);
 
 const char *cmdbs_error (struct cmdbs *o);
@@ -22,9 +27,50 @@ const char *cmdbs_next  (struct cmdbs *o, const char *key, const char *value);
 
 const char **cmdbs_list (struct cmdbs *o, const char *key);
 
+void cmdbs_key_init (struct cmdbs *o, struct cmdbc_key *k, const char *key);
+
+int cmdbs_exists_key (struct cmdbs *o, const struct cmdbc_key *k,
+		      const char *value);
+const char *cmdbs_first_key (struct cmdbs *o, const struct cmdbc_key *k);
+const char *cmdbs_next_key  (struct cmdbs *o, const struct cmdbc_key *k,
+			     const char *value);
+
+const char **cmdbs_list_key (struct cmdbs *o, const struct cmdbc_key *k);
+
+int  cmdbs_cursor_init (struct cmdbs *o, struct cmdbc_cursor *c,
+			const char *key);
+void cmdbs_cursor_fini (struct cmdbs *o, struct cmdbc_cursor *c);
+const char *cmdbs_cursor_next (struct cmdbs *o, struct cmdbc_cursor *c);
+
+/* hold read lock over many lookups */
+int  cmdbs_lock_read   (struct cmdbs *o);
+void cmdbs_unlock_read (struct cmdbs *o);
+
+/* serialize compound changes, may be nested */
+void cmdbs_write_begin (struct cmdbs *o);
+void cmdbs_write_end   (struct cmdbs *o);
+
+/* changes on every deletion: cached knowledge of nodes may be stale */
+size_t cmdbs_generation (struct cmdbs *o);
+
+void cmdbs_limit (struct cmdbs *o, size_t limit);
+int  cmdbs_limited (struct cmdbs *o);
+void cmdbs_stats (struct cmdbs *o, struct cmdb_stats *s);
+
 int cmdbs_store  (struct cmdbs *o, const char *key, const char *value);
+int cmdbs_store_list (struct cmdbs *o, const char *key, const char **list);
+int cmdbs_store_list_key (struct cmdbs *o, const struct cmdbc_key *k,
+			  const char **list);
 int cmdbs_delete (struct cmdbs *o, const char *key, const char *value);
+int cmdbs_copy   (struct cmdbs *o, const char *from, const char *to);
 
 int cmdbs_flush (struct cmdbs *o);
+int cmdbs_flush_nosync (struct cmdbs *o);
+
+/* flush and rebuild database, fails with ENOTSUP if backend cannot */
+int cmdbs_compact (struct cmdbs *o, struct cmdb_compact *s);
+
+/* write read-only snapshot of database, opened in place of it later */
+int cmdbs_snapshot (struct cmdbs *o, const char *path);
 
 #endif  /* CMDB_STORAGE_H */
@@ -0,0 +1,378 @@
+/*
+ * Configuration Management Database TDB Backend
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <tdb.h>
+#include <unistd.h>
+
+#include "cmdb-backend.h"
+
+struct cmdb_tdb {
+	struct cmdb_backend backend;
+	TDB_CONTEXT *db;
+	dev_t dev;  /* identity of database file */
+	ino_t ino;
+};
+
+/*
+ * Every user holds shared lock on database file: compaction takes it
+ * exclusive to replace the file. If file replaced while we wait for the
+ * lock, then new one opened.
+ */
+static TDB_CONTEXT *open_db (const char *path, int flags, struct stat *st)
+{
+	TDB_CONTEXT *db;
+	struct stat cur;
+
+	for (;;) {
+		/* sequence number tells about changes made by other processes */
+		if ((db = tdb_open (path, 0, TDB_SEQNUM, flags, 0666)) == NULL)
+			return NULL;
+
+		if (flock (tdb_fd (db), LOCK_SH) != 0 ||
+		    fstat (tdb_fd (db), st) != 0 || stat (path, &cur) != 0)
+			goto no_lock;
+
+		if (cur.st_dev == st->st_dev && cur.st_ino == st->st_ino)
+			return db;
+
+		tdb_close (db);
+	}
+no_lock:
+	tdb_close (db);
+	return NULL;
+}
+
+static struct cmdb_backend *tdb_backend_open (const char *path, int writable)
+{
+	struct cmdb_tdb *o;
+	int flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+	struct stat st;
+
+	if ((o = malloc (sizeof (*o))) == NULL)
+		return NULL;
+
+	o->backend.type = &cmdb_tdb_type;
+
+	if (writable && !cmdb_make_path (path))
+		goto no_db;
+
+	if ((o->db = open_db (path, flags, &st)) == NULL)
+		goto no_db;
+
+	o->dev = st.st_dev;
+	o->ino = st.st_ino;
+	return &o->backend;
+no_db:
+	free (o);
+	return NULL;
+}
+
+static int tdb_backend_close (struct cmdb_backend *b)
+{
+	struct cmdb_tdb *o = (void *) b;
+	int ok = tdb_close (o->db) == 0;
+
+	free (o);
+	return ok;
+}
+
+static const char *tdb_backend_error (struct cmdb_backend *b)
+{
+	struct cmdb_tdb *o = (void *) b;
+
+	return tdb_errorstr (o->db);
+}
+
+static int tdb_backend_same (struct cmdb_backend *b, const char *path)
+{
+	struct cmdb_tdb *o = (void *) b;
+	struct stat st;
+
+	return stat (path, &st) == 0 &&
+	       o->dev == st.st_dev && o->ino == st.st_ino;
+}
+
+static TDB_DATA make_data (const void *data, size_t size)
+{
+	TDB_DATA d;
+
+	d.dptr  = (void *) data;
+	d.dsize = size;
+	return d;
+}
+
+struct parse {
+	cmdb_backend_parser *fn;
+	void *cookie;
+	int found;
+};
+
+static int parser (TDB_DATA key, TDB_DATA data, void *cookie)
+{
+	struct parse *c = cookie;
+
+	c->found = 1;
+	return c->fn (data.dptr, data.dsize, c->cookie) ? 0 : -1;
+}
+
+/* records parsed in place from database mapping */
+static int tdb_backend_fetch (struct cmdb_backend *b, const void *key,
+			      size_t len, cmdb_backend_parser *fn,
+			      void *cookie)
+{
+	struct cmdb_tdb *o = (void *) b;
+	struct parse c = { fn, cookie, 0 };
+
+	if (tdb_parse_record (o->db, make_data (key, len), parser, &c) == 0)
+		return 1;
+
+	return c.found || tdb_error (o->db) != TDB_ERR_NOEXIST ? -1 : 0;
+}
+
+static int tdb_backend_store (struct cmdb_backend *b, const void *key,
+			      size_t len, const void *data, size_t size)
+{
+	struct cmdb_tdb *o = (void *) b;
+
+	return tdb_store (o->db, make_data (key, len), make_data (data, size),
+			  TDB_REPLACE) == 0;
+}
+
+static int tdb_backend_delete (struct cmdb_backend *b, const void *key,
+			       size_t len)
+{
+	struct cmdb_tdb *o = (void *) b;
+
+	return tdb_delete (o->db, make_data (key, len)) == 0 ||
+	       tdb_error (o->db) == TDB_ERR_NOEXIST;
+}
+
+static int tdb_backend_begin (struct cmdb_backend *b)
+{
+	struct cmdb_tdb *o = (void *) b;
+
+	return tdb_transaction_start (o->db) == 0;
+}
+
+static int tdb_backend_commit (struct cmdb_backend *b, int sync)
+{
+	struct cmdb_tdb *o = (void *) b;
+	int ok;
+
+	if (!sync)
+		tdb_add_flags (o->db, TDB_NOSYNC);
+
+	ok = tdb_transaction_commit (o->db) == 0;
+
+	if (!sync)
+		tdb_remove_flags (o->db, TDB_NOSYNC);
+
+	return ok;
+}
+
+static void tdb_backend_cancel (struct cmdb_backend *b)
+{
+	struct cmdb_tdb *o = (void *) b;
+
+	tdb_transaction_cancel (o->db);
+}
+
+struct iterate {
+	cmdb_backend_visitor *fn;
+	void *cookie;
+	int failed;
+};
+
+static int visitor (TDB_CONTEXT *db, TDB_DATA key, TDB_DATA data,
+		    void *cookie)
+{
+	struct iterate *c = cookie;
+
+	if (c->fn (key.dptr, key.dsize, data.dptr, data.dsize, c->cookie))
+		return 0;
+
+	c->failed = 1;
+	return -1;
+}
+
+static int tdb_backend_iterate (struct cmdb_backend *b,
+				cmdb_backend_visitor *fn, void *cookie)
+{
+	struct cmdb_tdb *o = (void *) b;
+	struct iterate c = { fn, cookie, 0 };
+
+	return tdb_traverse_read (o->db, visitor, &c) >= 0 && !c.failed;
+}
+
+static int tdb_backend_lock_read (struct cmdb_backend *b)
+{
+	struct cmdb_tdb *o = (void *) b;
+
+	return tdb_lockall_read (o->db) == 0;
+}
+
+static void tdb_backend_unlock_read (struct cmdb_backend *b)
+{
+	struct cmdb_tdb *o = (void *) b;
+
+	tdb_unlockall_read (o->db);
+}
+
+/* default hash size of TDB, and minimal one we use */
+#define HASH_MIN	131
+
+/* TDB hash works best with prime chain count */
+static size_t hash_size (size_t records)
+{
+	size_t n, i;
+
+	for (n = records > HASH_MIN ? records | 1 : HASH_MIN;; n += 2) {
+		for (i = 3; i * i <= n && n % i != 0; i += 2) {}
+
+		if (i * i > n)
+			return n;
+	}
+}
+
+struct copy {
+	TDB_CONTEXT *to;
+	size_t count;
+	int failed;
+};
+
+static int copier (TDB_CONTEXT *db, TDB_DATA key, TDB_DATA data,
+		   void *cookie)
+{
+	struct copy *c = cookie;
+
+	if (tdb_store (c->to, key, data, TDB_INSERT) == 0) {
+		++c->count;
+		return 0;
+	}
+
+	c->failed = 1;
+	return -1;
+}
+
+/*
+ * Records copied in one pass into fresh database written in one
+ * transaction, then it renamed over old one: freed space dropped and
+ * records laid out in traverse order. Old database locked meanwhile,
+ * and compaction refused if other processes have it open (EBUSY): they
+ * would keep using old file.
+ */
+static int tdb_backend_compact (struct cmdb_backend *b, struct cmdb_compact *s)
+{
+	struct cmdb_tdb *o = (void *) b;
+	const char *path = tdb_name (o->db);
+	char tmp[strlen (path) + 8];
+	struct copy c = { NULL, 0, 0 };
+	struct stat st;
+	int count, fd;
+
+	if (flock (tdb_fd (o->db), LOCK_EX | LOCK_NB) != 0) {
+		errno = EBUSY;
+		goto no_excl;
+	}
+
+	if (tdb_lockall (o->db) != 0)
+		goto no_excl;
+
+	if (fstat (tdb_fd (o->db), &st) != 0 ||
+	    (count = tdb_traverse_read (o->db, NULL, NULL)) < 0)
+		goto no_tmp;
+
+	s->size_before  = st.st_size;
+	s->hash_before  = tdb_hash_size (o->db);
+	s->chain_before = (double) count / s->hash_before;
+	s->hash_after   = hash_size (count);
+
+	snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+
+	if ((fd = mkstemp (tmp)) < 0)
+		goto no_tmp;
+
+	if (fchmod (fd, st.st_mode & 0777) != 0) {
+		close (fd);
+		goto no_db;
+	}
+
+	close (fd);
+
+	c.to = tdb_open (tmp, s->hash_after, TDB_SEQNUM, O_RDWR | O_CREAT,
+			 0666);
+	if (c.to == NULL)
+		goto no_db;
+
+	if (flock (tdb_fd (c.to), LOCK_SH) != 0 ||
+	    tdb_transaction_start (c.to) != 0)
+		goto no_copy;
+
+	if (tdb_traverse_read (o->db, copier, &c) < 0 || c.failed) {
+		tdb_transaction_cancel (c.to);
+		goto no_copy;
+	}
+
+	if (tdb_transaction_commit (c.to) != 0 ||
+	    fstat (tdb_fd (c.to), &st) != 0 || rename (tmp, path) != 0)
+		goto no_copy;
+
+	/* openers waiting for old file find new one */
+	tdb_close (o->db);
+
+	o->db  = c.to;
+	o->dev = st.st_dev;
+	o->ino = st.st_ino;
+
+	s->records     = c.count;
+	s->size_after  = st.st_size;
+	s->chain_after = (double) c.count / s->hash_after;
+	return 1;
+no_copy:
+	tdb_close (c.to);
+no_db:
+	unlink (tmp);
+no_tmp:
+	tdb_unlockall (o->db);
+no_excl:
+	flock (tdb_fd (o->db), LOCK_SH);
+	return 0;
+}
+
+static size_t tdb_backend_version (struct cmdb_backend *b)
+{
+	struct cmdb_tdb *o = (void *) b;
+
+	return tdb_get_seqnum (o->db);
+}
+
+const struct cmdb_backend_type cmdb_tdb_type = {
+	.open		= tdb_backend_open,
+	.close		= tdb_backend_close,
+	.error		= tdb_backend_error,
+	.same		= tdb_backend_same,
+	.fetch		= tdb_backend_fetch,
+	.store		= tdb_backend_store,
+	.delete		= tdb_backend_delete,
+	.begin		= tdb_backend_begin,
+	.commit		= tdb_backend_commit,
+	.cancel		= tdb_backend_cancel,
+	.iterate	= tdb_backend_iterate,
+	.lock_read	= tdb_backend_lock_read,
+	.unlock_read	= tdb_backend_unlock_read,
+	.compact	= tdb_backend_compact,
+	.version	= tdb_backend_version,
+};
@@ -39,9 +39,52 @@ static void show (struct cmdb *o, int level)
 	}
 }
 
+static void walk (struct cmdb *o, int level)
+{
+	struct cmdb_cursor *attrs, *nodes, *c;
+	const char *name, *p;
+
+	if ((attrs = cmdb_cursor_open (o, "\a")) == NULL ||
+	    (nodes = cmdb_cursor_open (o, "\n")) == NULL)
+		errx (1, "cannot open cursor");
+
+	while ((name = cmdb_cursor_next (attrs)) != NULL) {
+		if ((c = cmdb_cursor_open (o, name)) == NULL)
+			errx (1, "cannot open cursor");
+
+		while ((p = cmdb_cursor_next (c)) != NULL)
+			printf ("%*s%s = %s\n", level * 4, "", name, p);
+
+		cmdb_cursor_close (c);
+	}
+
+	while ((p = cmdb_cursor_next (nodes)) != NULL) {
+		printf ("%*s%s:\n", level * 4, "", p);
+
+		if (cmdb_push (o, p)) {
+			walk (o, level + 1);
+			cmdb_pop (o);
+		}
+	}
+
+	cmdb_cursor_close (nodes);
+	cmdb_cursor_close (attrs);
+}
+
+static const struct cmdb_pair sys[] = {
+	{ "name-server", "10.0.26.1" },
+	{ "domain-name", "example.org" },
+	{ "name-server", "10.0.26.2" },
+};
+
+static const char *ntp[] = { "0.pool.ntp.org", "1.pool.ntp.org", NULL };
+static const char *none[] = { NULL };
+
 int main (int argc, char *argv[])
 {
-	struct cmdb *o;
+	struct cmdb *o, *p;
+	struct cmdb_key *mtu;
+	struct cmdb_stats before, after;
 
 	if ((o = cmdb_open ("cmdb-test.db", "rwx")) == NULL)
 		errx (1, "cannot open database");
@@ -64,11 +107,39 @@ int main (int argc, char *argv[])
 	if (!cmdb_level (o, "system", NULL))
 		errx (1, "cannot set level");
 
-	if (!cmdb_store (o, "hostname", "cmdb-test"))
+	if (!cmdb_store (o, "hostname", "cmdb-test") ||
+	    !cmdb_store_many (o, sys, sizeof (sys) / sizeof (sys[0])))
 		errx (1, "cannot store: %s", cmdb_error (o));
 
-	if (!cmdb_level (o, NULL))
-		errx (1, "cannot set level");
+	/* unflushed changes visible through other handle */
+	if ((p = cmdb_open ("cmdb-test.db", "r")) == NULL ||
+	    !cmdb_level (p, "system", NULL))
+		errx (1, "cannot open shared handle");
+
+	printf ("shared handle: hostname = %s\n", cmdb_first (p, "hostname"));
+	printf ("shared handle: store %s, delete %s\n",
+		cmdb_store (p, "hostname", "read-only") ? "done" : "rejected",
+		cmdb_delete (p, "hostname", NULL) ? "done" : "rejected");
+	cmdb_close (p);
+
+	if (!cmdb_level (o, "system", "ntp", NULL) ||
+	    !cmdb_store_list (o, "server", ntp))
+		errx (1, "cannot store: %s", cmdb_error (o));
+
+	printf ("empty list %s, ghost %scatalogued\n",
+		cmdb_store_list (o, "ghost", none) ? "stored" : "rejected",
+		cmdb_exists (o, "\a", "ghost") ? "" : "not ");
+
+	if (!cmdb_level (o, "interfaces", "ethernet eth4", NULL) ||
+	    (mtu = cmdb_key_compile (o, "mtu")) == NULL)
+		errx (1, "cannot compile key");
+
+	if (!cmdb_level (o, NULL) || !cmdb_store_key (o, mtu, "1500"))
+		errx (1, "cannot store: %s", cmdb_error (o));
+
+	printf ("mtu 1500 %sfound\n",
+		cmdb_exists_key (o, mtu, "1500") ? "" : "not ");
+	cmdb_key_free (mtu);
 
 	printf ("\n");
 	printf ("-------- show --------\n");
@@ -81,12 +152,48 @@ int main (int argc, char *argv[])
 	if (!cmdb_flush (o))
 		errx (1, "cannot flush: %s", cmdb_error (o));
 
+	if (!cmdb_level (o, "interfaces", NULL) ||
+	    !cmdb_copy (o, "ethernet eth1", "ethernet eth2") ||
+	    !cmdb_move (o, "ethernet eth2", "ethernet eth3"))
+		errx (1, "cannot copy: %s", cmdb_error (o));
+
+	if (!cmdb_flush_nosync (o))
+		errx (1, "cannot flush: %s", cmdb_error (o));
+
 	if (!cmdb_level (o, NULL))
 		errx (1, "cannot set level");
 
+	printf ("\n");
+	printf ("-------- walk --------\n");
+	walk (o, 0);
+
 	printf ("\n");
 	printf ("-------- save --------\n");
 	cmdb_save (o, stdout);
 	cmdb_close (o);
+
+	if ((o = cmdb_open ("cmdb-test.db", "r")) == NULL)
+		errx (1, "cannot open database");
+
+	if (!cmdb_prefetch (o))
+		errx (1, "cannot prefetch: %s", cmdb_error (o));
+
+	cmdb_stats (o, &before);
+	walk (o, 0);
+	cmdb_stats (o, &after);
+
+	printf ("\n");
+	printf ("prefetched %zu keys, walk missed %zu\n",
+		before.misses, after.misses - before.misses);
+
+	cmdb_limit (o, 1);
+	cmdb_stats (o, &before);
+
+	if (!cmdb_prefetch (o))
+		errx (1, "cannot prefetch: %s", cmdb_error (o));
+
+	cmdb_stats (o, &after);
+	printf ("limited prefetch missed %zu\n", after.misses - before.misses);
+	cmdb_close (o);
 	return 0;
 }
@@ -0,0 +1,124 @@
+/*
+ * Configuration Management Database Thread Scaling Benchmark
+ *
+ * Copyright (c) 2019-2022 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <err.h>
+#include <pthread.h>
+
+#include "cmdb.h"
+
+#define NODES	20
+#define ATTRS	10
+#define COUNT	200000
+#define THREADS	8
+
+static double now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void set_level (struct cmdb *o, int i)
+{
+	char node[32];
+
+	snprintf (node, sizeof (node), "node %d", i);
+
+	if (!cmdb_level (o, "bench", node, NULL))
+		errx (1, "cannot set level");
+}
+
+static void fill (struct cmdb *o)
+{
+	char name[32], value[32];
+	int i, j;
+
+	for (i = 0; i < NODES; ++i) {
+		set_level (o, i);
+
+		for (j = 0; j < ATTRS; ++j) {
+			snprintf (name,  sizeof (name),  "attr-%d", j);
+			snprintf (value, sizeof (value), "value %d", i * j);
+
+			if (!cmdb_store (o, name, value))
+				errx (1, "cannot store: %s", cmdb_error (o));
+		}
+	}
+}
+
+/* every reader uses its own session */
+static void *reader (void *cookie)
+{
+	struct cmdb *o = cookie;
+	char name[32];
+	int i;
+
+	for (i = 0; i < COUNT; ++i) {
+		set_level (o, i % NODES);
+		snprintf (name, sizeof (name), "attr-%d", i % ATTRS);
+
+		if (cmdb_first (o, name) == NULL)
+			errx (1, "cannot find %s", name);
+	}
+
+	return NULL;
+}
+
+static void run (struct cmdb *o, int count)
+{
+	struct cmdb *s[THREADS];
+	pthread_t t[THREADS];
+	double start;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		if ((s[i] = cmdb_session (o)) == NULL)
+			errx (1, "cannot open session");
+
+	start = now ();
+
+	for (i = 0; i < count; ++i)
+		if (pthread_create (t + i, NULL, reader, s[i]) != 0)
+			errx (1, "cannot start thread");
+
+	for (i = 0; i < count; ++i)
+		pthread_join (t[i], NULL);
+
+	printf ("%d threads: %8.1f ns/op, %6.2f Mops/s total\n", count,
+		(now () - start) / COUNT,
+		count * COUNT * 1e3 / (now () - start));
+
+	for (i = 0; i < count; ++i)
+		cmdb_close (s[i]);
+}
+
+int main (int argc, char *argv[])
+{
+	struct cmdb *o;
+	int i;
+
+	if ((o = cmdb_open ("cmdb-thread.db", "rwx")) == NULL)
+		errx (1, "cannot open database");
+
+	fill (o);
+
+	for (i = 1; i <= THREADS; i *= 2)
+		run (o, i);
+
+	if (!cmdb_level (o, "bench", NULL) || !cmdb_delete (o, NULL, NULL) ||
+	    !cmdb_flush_nosync (o))
+		errx (1, "cannot drop nodes: %s", cmdb_error (o));
+
+	cmdb_close (o);
+	return 0;
+}
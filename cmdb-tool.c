@@ -23,7 +23,9 @@ static int usage (void)
 		 "\tlevel [<node> ...]\n"
 		 "\tstore <attr> <value>\n"
 		 "\tdelete <attr> [<value>]\n"
-		 "\tshow\n");
+		 "\tshow\n"
+		 "\tsnapshot <file>\n"
+		 "\tcompact\n");
 
 	return 1;
 }
@@ -96,6 +98,39 @@ static int do_show (struct cmdb *o, char **argv)
 	return 1;
 }
 
+static int do_snapshot (struct cmdb *o, char **argv)
+{
+	++argv;
+
+	if (*argv == NULL || strcmp (*argv, ",") == 0)
+		errx (1, "cmdb snapshot: file name required");
+
+	if (!cmdb_snapshot (o, *argv))
+		err (1, "cmdb snapshot: %s", *argv);
+
+	return 2;
+}
+
+static int do_compact (struct cmdb *o, char **argv)
+{
+	struct cmdb_compact s;
+
+	if (!cmdb_compact (o, &s))
+		err (1, "cmdb compact");
+
+	printf ("records:       %zu\n"
+		"size:          %zu -> %zu bytes\n",
+		s.records, s.size_before, s.size_after);
+
+	if (s.hash_after > 0)
+		printf ("hash size:     %zu -> %zu\n"
+			"average chain: %.2f -> %.2f\n",
+			s.hash_before, s.hash_after,
+			s.chain_before, s.chain_after);
+
+	return 1;
+}
+
 int main (int argc, char *argv[])
 {
 	struct cmdb *o;
@@ -118,6 +153,10 @@ int main (int argc, char *argv[])
 			n = do_delete (o, argv);
 		else if (strcmp (argv[0], "show") == 0)
 			n = do_show (o, argv);
+		else if (strcmp (argv[0], "snapshot") == 0)
+			n = do_snapshot (o, argv);
+		else if (strcmp (argv[0], "compact") == 0)
+			n = do_compact (o, argv);
 		else
 			errx (1, "unknown command: %s", argv[0]);
 
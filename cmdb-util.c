@@ -99,6 +99,9 @@ static void show (struct cmdb *o, FILE *to, int level)
 
 int cmdb_save (struct cmdb *o, FILE *to)
 {
+	if (!cmdb_prefetch (o))
+		return 0;
+
 	show (o, to, 0);
 	return !ferror (to);
 }
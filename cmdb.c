@@ -7,8 +7,10 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cmdb.h"
 #include "cmdb-path.h"
@@ -17,22 +19,48 @@
 struct cmdb {
 	struct cmdbs *db;
 	struct cmdb_path path;
+	struct cmdb_path node;  /* deepest node known to exist */
+	size_t generation;      /* storage generation node known at */
+	int writable;           /* storage may be shared with writers */
 };
 
-struct cmdb *cmdb_open (const char *path, const char *mode)
+static struct cmdb *cmdb_alloc (struct cmdbs *db, int writable)
 {
 	struct cmdb *o;
 
 	if ((o = malloc (sizeof (*o))) == NULL)
 		return NULL;
 
-	if ((o->db = cmdbs_open (path, mode)) == NULL)
-		goto no_db;
-
+	o->db = db;
 	cmdb_path_init (&o->path);
+	cmdb_path_init (&o->node);
+	o->generation = 0;
+	o->writable = writable;
 	return o;
-no_db:
-	return NULL;
+}
+
+struct cmdb *cmdb_open (const char *path, const char *mode)
+{
+	struct cmdbs *db;
+	struct cmdb *o;
+
+	if ((db = cmdbs_open (path, mode)) == NULL)
+		return NULL;
+
+	if ((o = cmdb_alloc (db, strchr (mode, 'w') != NULL)) == NULL)
+		cmdbs_close (db);
+
+	return o;
+}
+
+struct cmdb *cmdb_session (struct cmdb *o)
+{
+	struct cmdb *s;
+
+	if ((s = cmdb_alloc (cmdbs_get (o->db), o->writable)) == NULL)
+		cmdbs_close (o->db);
+
+	return s;
 }
 
 int cmdb_close (struct cmdb *o)
@@ -42,8 +70,16 @@ int cmdb_close (struct cmdb *o)
 	if (o == NULL)
 		return ret;
 
+	cmdb_path_fini (&o->node);
 	cmdb_path_fini (&o->path);
 
+	/*
+	 * Writer flushes on close: its changes are durable even if other
+	 * users keep database open. Readers leave writer batch intact.
+	 */
+	if (o->writable && !cmdbs_flush (o->db))
+		ret = 0;
+
 	if (!cmdbs_close (o->db))
 		ret = 0;
 
@@ -56,6 +92,21 @@ const char *cmdb_error (struct cmdb *o)
 	return cmdbs_error (o->db);
 }
 
+/*
+ * Storage shared with writable handle is writable itself: read-only
+ * handle checked here.
+ */
+static int write_begin (struct cmdb *o)
+{
+	if (!o->writable) {
+		errno = EROFS;
+		return 0;
+	}
+
+	cmdbs_write_begin (o->db);
+	return 1;
+}
+
 int cmdb_push (struct cmdb *o, const char *name)
 {
 	return cmdb_path_push (&o->path, name);
@@ -119,11 +170,89 @@ const char **cmdb_list (struct cmdb *o, const char *name)
 	return cmdbs_list (o->db, o->path.path);
 }
 
+struct cmdb_cursor {
+	struct cmdbs *db;
+	struct cmdbc_cursor c;
+};
+
+struct cmdb_cursor *cmdb_cursor_open (struct cmdb *o, const char *name)
+{
+	struct cmdb_cursor *c;
+
+	if (!cmdb_path_set (&o->path, name) ||
+	    (c = malloc (sizeof (*c))) == NULL)
+		return NULL;
+
+	if (!cmdbs_cursor_init (o->db, &c->c, o->path.path))
+		goto no_init;
+
+	c->db = o->db;
+	return c;
+no_init:
+	free (c);
+	return NULL;
+}
+
+const char *cmdb_cursor_next (struct cmdb_cursor *c)
+{
+	return cmdbs_cursor_next (c->db, &c->c);
+}
+
+void cmdb_cursor_close (struct cmdb_cursor *c)
+{
+	if (c == NULL)
+		return;
+
+	cmdbs_cursor_fini (c->db, &c->c);
+	free (c);
+}
+
+void cmdb_stats (struct cmdb *o, struct cmdb_stats *s)
+{
+	cmdbs_stats (o->db, s);
+}
+
+void cmdb_limit (struct cmdb *o, size_t limit)
+{
+	cmdbs_limit (o->db, limit);
+}
+
+/* level of path is the known node or one of its ancestors */
+static int node_known (struct cmdb *o, const struct cmdb_path *p)
+{
+	size_t len = p->prefix;
+
+	return len <= o->node.prefix &&
+	       o->generation == cmdbs_generation (o->db) &&
+	       memcmp (p->path, o->node.path, len) == 0 &&
+	       (o->node.path[len] == '\0' || o->node.path[len] == '\n');
+}
+
+static void node_forget (struct cmdb *o)
+{
+	cmdb_path_reset (&o->node);
+}
+
+static int node_remember (struct cmdb *o)
+{
+	if (!cmdb_path_copy (&o->node, &o->path)) {
+		node_forget (o);
+		return 0;
+	}
+
+	o->node.path[o->node.len = o->node.prefix] = '\0';
+	o->generation = cmdbs_generation (o->db);
+	return 1;
+}
+
 static int make_node (struct cmdb *o)
 {
 	struct cmdb_path backup, work;
 	const char *name;
 
+	if (node_known (o, &o->path))
+		return 1;
+
 	cmdb_path_init (&backup);
 
 	if (!cmdb_path_copy (&backup, &o->path))
@@ -134,19 +263,24 @@ static int make_node (struct cmdb *o)
 	if (!cmdb_path_copy (&work, &o->path))
 		goto no_work;
 
+	/* link nodes bottom-up until existing one found */
 	while ((name = cmdb_path_pop (&work)) != NULL) {
 		cmdb_path_pop (&o->path);
 
-		if (cmdb_exists (o, "\n", name))
+		if (!cmdb_path_set (&o->path, "\n"))
+			goto no_store;
+
+		if (cmdbs_exists (o->db, o->path.path, name))
 			break;
 
-		if (!cmdb_store (o, "\n", name))
+		if (!cmdbs_store (o->db, o->path.path, name))
 			goto no_store;
 	}
 
 	cmdb_path_fini (&work);
 	cmdb_path_copy (&o->path, &backup);
 	cmdb_path_fini (&backup);
+	node_remember (o);
 	return 1;
 no_store:
 	cmdb_path_fini (&work);
@@ -156,7 +290,7 @@ no_work:
 	return 0;
 }
 
-int cmdb_store (struct cmdb *o, const char *name, const char *value)
+static int store (struct cmdb *o, const char *name, const char *value)
 {
 	if (!make_node (o) ||
 	    !cmdb_path_set (&o->path, name) ||
@@ -171,29 +305,353 @@ int cmdb_store (struct cmdb *o, const char *name, const char *value)
 	       cmdbs_store (o->db, o->path.path, name);
 }
 
-static int drop_node (struct cmdb *o)
+int cmdb_store (struct cmdb *o, const char *name, const char *value)
 {
-	const char *p;
+	int ok;
 
-	for (p = cmdb_first (o, "\n"); p != NULL; p = cmdb_next (o, "\n", p))
-		if (cmdb_path_push (&o->path, p)) {
-			drop_node (o);
-			cmdb_path_pop (&o->path);
+	if (!write_begin (o))
+		return 0;
+
+	ok = store (o, name, value);
+	cmdbs_write_end (o->db);
+	return ok;
+}
+
+static int store_list (struct cmdb *o, const char *name, const char **list)
+{
+	const char *names[] = { name, NULL };
+
+	if (!make_node (o) ||
+	    !cmdb_path_set (&o->path, name) ||
+	    !cmdbs_store_list (o->db, o->path.path, list))
+		return 0;
+
+	if (iscntrl (name[0]))
+		return 1;
+
+	return cmdb_path_set (&o->path, "\a") &&
+	       cmdbs_store_list (o->db, o->path.path, names);
+}
+
+int cmdb_store_list (struct cmdb *o, const char *name, const char **list)
+{
+	int ok;
+
+	/* attribute without values should not be catalogued */
+	if (list[0] == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (!write_begin (o))
+		return 0;
+
+	ok = store_list (o, name, list);
+	cmdbs_write_end (o->db);
+	return ok;
+}
+
+static int pair_cmp (const void *a, const void *b)
+{
+	const struct cmdb_pair *const *p = a;
+	const struct cmdb_pair *const *q = b;
+
+	return strcmp ((*p)->name, (*q)->name);
+}
+
+/*
+ * Pairs grouped by attribute name: every attribute stored with one
+ * list store, node created and attribute catalogue updated once per
+ * batch.
+ */
+static int store_many (struct cmdb *o, const struct cmdb_pair *list,
+		       size_t count)
+{
+	const struct cmdb_pair **pairs;
+	const char **names, **values, *name;
+	size_t i, j, n, m;
+	int ok = 1;
+
+	if (!make_node (o) ||
+	    (pairs = malloc (sizeof (pairs[0]) * (count + 1))) == NULL)
+		return 0;
+
+	if ((names = malloc (sizeof (names[0]) * (count + 1) * 2)) == NULL)
+		goto no_names;
+
+	values = names + count + 1;
+
+	for (i = 0; i < count; ++i)
+		pairs[i] = list + i;
+
+	qsort (pairs, count, sizeof (pairs[0]), pair_cmp);
+
+	for (i = 0, n = 0; i < count; i = j) {
+		name = pairs[i]->name;
+
+		for (j = i, m = 0; j < count; ++j) {
+			if (strcmp (pairs[j]->name, name) != 0)
+				break;
+
+			values[m++] = pairs[j]->value;
+		}
+
+		values[m] = NULL;
+
+		if (!cmdb_path_set (&o->path, name) ||
+		    !cmdbs_store_list (o->db, o->path.path, values)) {
+			ok = 0;
+			break;
 		}
 
-	cmdb_delete (o, "\n", NULL);
+		if (!iscntrl (name[0]))
+			names[n++] = name;
+	}
 
-	for (p = cmdb_first (o, "\a"); p != NULL; p = cmdb_next (o, "\a", p))
-		cmdb_delete (o, p, NULL);
+	names[n] = NULL;
 
-	cmdb_delete (o, "\a", NULL);
-	return 1;
+	/* catalogue attributes stored so far */
+	if (n > 0 && (!cmdb_path_set (&o->path, "\a") ||
+		      !cmdbs_store_list (o->db, o->path.path, names)))
+		ok = 0;
+
+	free (names);
+	free (pairs);
+	return ok;
+no_names:
+	free (pairs);
+	return 0;
 }
 
-int cmdb_delete (struct cmdb *o, const char *name, const char *value)
+int cmdb_store_many (struct cmdb *o, const struct cmdb_pair *list,
+		     size_t count)
+{
+	int ok;
+
+	if (!write_begin (o))
+		return 0;
+
+	ok = store_many (o, list, count);
+	cmdbs_write_end (o->db);
+	return ok;
+}
+
+struct cmdb_key {
+	struct cmdb_path path, cat;	/* attribute and its catalogue */
+	struct cmdbc_key key, names;
+	const char *name;		/* NULL if not catalogued */
+};
+
+/*
+ * Key compiled once: path formatted and hashed here, not on every
+ * access.
+ */
+struct cmdb_key *cmdb_key_compile (struct cmdb *o, const char *name)
+{
+	struct cmdb_key *k;
+
+	if ((k = malloc (sizeof (*k))) == NULL)
+		return NULL;
+
+	cmdb_path_init (&k->path);
+	cmdb_path_init (&k->cat);
+
+	if (!cmdb_path_copy (&k->path, &o->path) ||
+	    !cmdb_path_set  (&k->path, name) ||
+	    !cmdb_path_copy (&k->cat,  &k->path) ||
+	    !cmdb_path_set  (&k->cat,  "\a"))
+		goto no_path;
+
+	cmdbs_key_init (o->db, &k->key,   k->path.path);
+	cmdbs_key_init (o->db, &k->names, k->cat.path);
+
+	k->name = iscntrl (name[0]) ? NULL : k->path.path + k->path.prefix + 1;
+	return k;
+no_path:
+	cmdb_key_free (k);
+	return NULL;
+}
+
+void cmdb_key_free (struct cmdb_key *k)
+{
+	if (k == NULL)
+		return;
+
+	cmdb_path_fini (&k->cat);
+	cmdb_path_fini (&k->path);
+	free (k);
+}
+
+int cmdb_exists_key (struct cmdb *o, const struct cmdb_key *k,
+		     const char *value)
+{
+	return cmdbs_exists_key (o->db, &k->key, value);
+}
+
+const char *cmdb_first_key (struct cmdb *o, const struct cmdb_key *k)
+{
+	return cmdbs_first_key (o->db, &k->key);
+}
+
+const char *cmdb_next_key (struct cmdb *o, const struct cmdb_key *k,
+			   const char *value)
+{
+	return cmdbs_next_key (o->db, &k->key, value);
+}
+
+const char **cmdb_list_key (struct cmdb *o, const struct cmdb_key *k)
+{
+	return cmdbs_list_key (o->db, &k->key);
+}
+
+/* create node of key level, current level kept intact */
+static int make_key_node (struct cmdb *o, const struct cmdb_key *k)
+{
+	struct cmdb_path backup;
+	int ok;
+
+	if (node_known (o, &k->path))
+		return 1;
+
+	cmdb_path_init (&backup);
+
+	if (!cmdb_path_copy (&backup, &o->path))
+		return 0;
+
+	ok = cmdb_path_copy (&o->path, &k->path) &&
+	     make_node (o);
+
+	cmdb_path_copy (&o->path, &backup);
+	cmdb_path_fini (&backup);
+	return ok;
+}
+
+static int store_key (struct cmdb *o, const struct cmdb_key *k,
+		      const char *value)
+{
+	const char *list[]  = { value, NULL };
+	const char *names[] = { k->name, NULL };
+
+	if (!make_key_node (o, k) ||
+	    !cmdbs_store_list_key (o->db, &k->key, list))
+		return 0;
+
+	return k->name == NULL ||
+	       cmdbs_store_list_key (o->db, &k->names, names);
+}
+
+int cmdb_store_key (struct cmdb *o, const struct cmdb_key *k,
+		    const char *value)
+{
+	int ok;
+
+	if (!write_begin (o))
+		return 0;
+
+	ok = store_key (o, k, value);
+	cmdbs_write_end (o->db);
+	return ok;
+}
+
+typedef int node_visitor (struct cmdb *o, void *cookie);
+
+/*
+ * Visit every node of subtree of current level, children first. No
+ * recursion: explicit stack of child list cursors used, and the path
+ * of the handle set to the level of visited node.
+ */
+static int walk (struct cmdb *o, node_visitor *fn, void *cookie)
+{
+	struct cmdbc_cursor *stack = NULL, *p;
+	size_t depth = 0, size = 0;
+	const char *name = NULL;
+	int ok = 1;
+
+	do {
+		if (depth == size) {
+			size = size == 0 ? 8 : size * 2;
+
+			if ((p = realloc (stack, sizeof (p[0]) * size)) == NULL)
+				goto error;
+
+			stack = p;
+		}
+
+		if ((name != NULL && !cmdb_path_push (&o->path, name)) ||
+		    !cmdb_path_set (&o->path, "\n"))
+			goto error;
+
+		if (!cmdbs_cursor_init (o->db, stack + depth, o->path.path)) {
+			if (name != NULL)
+				cmdb_path_pop (&o->path);
+
+			goto error;
+		}
+
+		for (++depth; depth > 0; --depth) {
+			name = cmdbs_cursor_next (o->db, stack + depth - 1);
+
+			if (name != NULL)
+				break;  /* descend */
+
+			cmdbs_cursor_fini (o->db, stack + depth - 1);
+
+			if (!fn (o, cookie))
+				ok = 0;
+
+			if (depth > 1)
+				cmdb_path_pop (&o->path);
+		}
+	}
+	while (depth > 0);
+
+	free (stack);
+	return ok;
+error:
+	for (; depth > 0; --depth) {
+		cmdbs_cursor_fini (o->db, stack + depth - 1);
+
+		if (depth > 1)
+			cmdb_path_pop (&o->path);
+	}
+
+	free (stack);
+	return 0;
+}
+
+/*
+ * Attribute values not fetched to be deleted: whole sets dropped.
+ */
+static int drop (struct cmdb *o, void *cookie)
+{
+	struct cmdbc_cursor c;
+	const char *p;
+	int ok = 1;
+
+	if (!cmdb_path_set (&o->path, "\a") ||
+	    !cmdbs_cursor_init (o->db, &c, o->path.path))
+		return 0;
+
+	while ((p = cmdbs_cursor_next (o->db, &c)) != NULL)
+		if (!cmdb_path_set (&o->path, p) ||
+		    !cmdbs_delete (o->db, o->path.path, NULL))
+			ok = 0;
+
+	cmdbs_cursor_fini (o->db, &c);
+
+	return cmdb_path_set (&o->path, "\a") &&
+	       cmdbs_delete (o->db, o->path.path, NULL) &&
+	       cmdb_path_set (&o->path, "\n") &&
+	       cmdbs_delete (o->db, o->path.path, NULL) && ok;
+}
+
+static int erase (struct cmdb *o, const char *name, const char *value)
 {
+	if (name == NULL || name[0] == '\n')
+		node_forget (o);
+
 	if (name == NULL)
-		return drop_node (o);
+		return walk (o, drop, NULL);
 
 	if (!cmdb_path_set (&o->path, name) ||
 	    !cmdbs_delete (o->db, o->path.path, value))
@@ -207,7 +665,186 @@ int cmdb_delete (struct cmdb *o, const char *name, const char *value)
 	       cmdbs_delete (o->db, o->path.path, name);
 }
 
+int cmdb_delete (struct cmdb *o, const char *name, const char *value)
+{
+	int ok;
+
+	if (!write_begin (o))
+		return 0;
+
+	ok = erase (o, name, value);
+	cmdbs_write_end (o->db);
+	return ok;
+}
+
+/* load attribute catalogue and all attributes of current level */
+static int prefetch (struct cmdb *o, void *cookie)
+{
+	struct cmdbc_cursor c;
+	const char *p;
+
+	if (!cmdb_path_set (&o->path, "\a") ||
+	    !cmdbs_cursor_init (o->db, &c, o->path.path))
+		return 0;
+
+	while ((p = cmdbs_cursor_next (o->db, &c)) != NULL)
+		if (cmdb_path_set (&o->path, p))
+			cmdbs_first (o->db, o->path.path);
+
+	cmdbs_cursor_fini (o->db, &c);
+	return 1;
+}
+
+/*
+ * Whole subtree loaded under one database read lock: no per-lookup
+ * chain locking. Works without the lock if it cannot be taken. Skipped
+ * if cache limited: records would be trimmed before walk uses them.
+ */
+int cmdb_prefetch (struct cmdb *o)
+{
+	int locked, ok;
+
+	if (cmdbs_limited (o->db))
+		return 1;
+
+	locked = cmdbs_lock_read (o->db);
+	ok = walk (o, prefetch, NULL);
+
+	if (locked)
+		cmdbs_unlock_read (o->db);
+
+	return ok;
+}
+
+struct copy {
+	size_t from;          /* source prefix length */
+	struct cmdb_path to;  /* target prefix */
+};
+
+/* copy record of current key to the target with prefix rewritten */
+static int copy_key (struct cmdb *o, struct copy *c)
+{
+	return cmdb_path_set (&c->to, o->path.path + c->from) &&
+	       cmdbs_copy (o->db, o->path.path, c->to.path);
+}
+
+static int copy (struct cmdb *o, void *cookie)
+{
+	struct copy *c = cookie;
+	struct cmdbc_cursor cur;
+	const char *p;
+	int ok = 1;
+
+	if (!cmdb_path_set (&o->path, "\a") ||
+	    !cmdbs_cursor_init (o->db, &cur, o->path.path))
+		return 0;
+
+	while ((p = cmdbs_cursor_next (o->db, &cur)) != NULL)
+		if (!cmdb_path_set (&o->path, p) || !copy_key (o, c))
+			ok = 0;
+
+	cmdbs_cursor_fini (o->db, &cur);
+
+	return cmdb_path_set (&o->path, "\a") && copy_key (o, c) &&
+	       cmdb_path_set (&o->path, "\n") && copy_key (o, c) && ok;
+}
+
+/*
+ * Subtree copied key by key in storage: node lists, catalogues and
+ * attributes copied as whole sets, no per-value API calls.
+ */
+static int copy_node (struct cmdb *o, const char *from, const char *to)
+{
+	struct copy c;
+	int ok;
+
+	if (!cmdb_exists (o, "\n", from)) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	if (cmdb_exists (o, "\n", to)) {
+		errno = EEXIST;
+		return 0;
+	}
+
+	cmdb_path_init (&c.to);
+
+	if (!cmdb_path_copy (&c.to, &o->path) ||
+	    !cmdb_path_push (&c.to, to) ||
+	    !cmdb_path_push (&o->path, from))
+		goto no_path;
+
+	c.from = o->path.prefix;
+	ok = walk (o, copy, &c);
+	cmdb_path_pop (&o->path);
+	cmdb_path_fini (&c.to);
+
+	return ok && store (o, "\n", to);
+no_path:
+	cmdb_path_fini (&c.to);
+	return 0;
+}
+
+static int move_node (struct cmdb *o, const char *from, const char *to)
+{
+	int ok;
+
+	if (!copy_node (o, from, to) || !cmdb_path_push (&o->path, from))
+		return 0;
+
+	node_forget (o);
+	ok = walk (o, drop, NULL);
+	cmdb_path_pop (&o->path);
+
+	return erase (o, "\n", from) && ok;
+}
+
+int cmdb_copy (struct cmdb *o, const char *from, const char *to)
+{
+	int ok;
+
+	if (!write_begin (o))
+		return 0;
+
+	ok = copy_node (o, from, to);
+	cmdbs_write_end (o->db);
+	return ok;
+}
+
+int cmdb_move (struct cmdb *o, const char *from, const char *to)
+{
+	int ok;
+
+	if (!write_begin (o))
+		return 0;
+
+	ok = move_node (o, from, to);
+	cmdbs_write_end (o->db);
+	return ok;
+}
+
 int cmdb_flush (struct cmdb *o)
 {
 	return cmdbs_flush (o->db);
 }
+
+int cmdb_flush_nosync (struct cmdb *o)
+{
+	return cmdbs_flush_nosync (o->db);
+}
+
+int cmdb_compact (struct cmdb *o, struct cmdb_compact *s)
+{
+	if (!o->writable) {
+		errno = EROFS;
+		return 0;
+	}
+
+	return cmdbs_compact (o->db, s);
+}
+
+int cmdb_snapshot (struct cmdb *o, const char *path)
+{
+	return cmdbs_snapshot (o->db, path);
+}
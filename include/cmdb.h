@@ -11,9 +11,32 @@
 
 #include <stddef.h>
 
+/*
+ * Handles opened to the same database file in process share storage
+ * and cache: changes made through one handle visible through others
+ * before flush, and flush of any handle writes them all. Database
+ * opened read-only cannot be opened for writing until closed (EBUSY).
+ * Changes flushed by other processes seen on next access, values they
+ * changed returned before stay valid until database changed again or
+ * next flush.
+ *
+ * Mode letters: "w" opens database for writing, "m" opens in-memory
+ * database named by path, it lives while any handle to it is open, "j"
+ * opens append-only journal: fast writes, whole database kept in memory
+ * and only one process may open it for writing.
+ */
 struct cmdb *cmdb_open (const char *path, const char *mode);
 int cmdb_close (struct cmdb *o);
 
+/*
+ * Open new session to the same database: it has its own current level
+ * and shares cache with other sessions. Every thread should use its own
+ * session. Database closed with last session. Returned values stay
+ * valid until their attribute deleted by any session or flushed out
+ * of cache.
+ */
+struct cmdb *cmdb_session (struct cmdb *o);
+
 const char *cmdb_error (struct cmdb *o);
 
 int cmdb_push (struct cmdb *o, const char *name);
@@ -28,9 +51,109 @@ const char *cmdb_next  (struct cmdb *o, const char *name, const char *value);
 
 const char **cmdb_list (struct cmdb *o, const char *name);
 
+/*
+ * Cursor resolves attribute or child list ("\n") of current level once
+ * and walks its values in sorted order. Cursor should be closed before
+ * database closed.
+ */
+struct cmdb_cursor *cmdb_cursor_open (struct cmdb *o, const char *name);
+const char *cmdb_cursor_next (struct cmdb_cursor *c);
+void cmdb_cursor_close (struct cmdb_cursor *c);
+
+/*
+ * Compiled key of attribute (or child list) of current level: path
+ * encoded and hashed once, then used for fast repeated access. Key
+ * stays bound to the level it compiled at.
+ */
+struct cmdb_key *cmdb_key_compile (struct cmdb *o, const char *name);
+void cmdb_key_free (struct cmdb_key *k);
+
+int cmdb_exists_key (struct cmdb *o, const struct cmdb_key *k,
+		     const char *value);
+const char *cmdb_first_key (struct cmdb *o, const struct cmdb_key *k);
+const char *cmdb_next_key  (struct cmdb *o, const struct cmdb_key *k,
+			    const char *value);
+
+const char **cmdb_list_key (struct cmdb *o, const struct cmdb_key *k);
+
+int cmdb_store_key (struct cmdb *o, const struct cmdb_key *k,
+		    const char *value);
+
+/*
+ * Load whole subtree of current level into cache in one pass: walks of
+ * it served from memory later. Does nothing if cache memory limited.
+ */
+int cmdb_prefetch (struct cmdb *o);
+
+struct cmdb_stats {
+	size_t hits;		/* lookups served from cache		*/
+	size_t negative;	/* lookups of known absent keys		*/
+	size_t misses;		/* lookups passed to database		*/
+	size_t memory;		/* memory used by cache in bytes	*/
+	size_t evictions;	/* unchanged records dropped from cache	*/
+	size_t refetches;	/* evicted keys loaded again (approx)	*/
+};
+
+void cmdb_stats (struct cmdb *o, struct cmdb_stats *s);
+
+/*
+ * Limit cache memory usage, zero for unlimited (default). Cache trimmed
+ * to the limit on flush and on cache miss: strings returned before may
+ * become invalid after it if the limit set.
+ */
+void cmdb_limit (struct cmdb *o, size_t limit);
+
 int cmdb_store  (struct cmdb *o, const char *name, const char *value);
+
+struct cmdb_pair {
+	const char *name, *value;
+};
+
+/*
+ * Store list of attribute values at current level at once: pairs
+ * grouped by name, order of pairs does not matter.
+ */
+int cmdb_store_many (struct cmdb *o, const struct cmdb_pair *list,
+		     size_t count);
+/* store NULL-terminated list of values of attribute, fails if empty */
+int cmdb_store_list (struct cmdb *o, const char *name, const char **list);
+
 int cmdb_delete (struct cmdb *o, const char *name, const char *value);
 
+/*
+ * Copy or move (rename) child node of current level with all its
+ * subtree to new child node. Target node should not exist.
+ */
+int cmdb_copy (struct cmdb *o, const char *from, const char *to);
+int cmdb_move (struct cmdb *o, const char *from, const char *to);
+
+/* write all changes atomically and wait for them to reach the disk */
 int cmdb_flush (struct cmdb *o);
+/* write all changes atomically without waiting for disk sync */
+int cmdb_flush_nosync (struct cmdb *o);
+
+struct cmdb_compact {
+	size_t records;		/* records in database			*/
+	size_t size_before;	/* database file size in bytes		*/
+	size_t size_after;
+	size_t hash_before;	/* hash chains count, zero if no hash	*/
+	size_t hash_after;
+	double chain_before;	/* average hash chain length		*/
+	double chain_after;
+};
+
+/*
+ * Flush changes and rebuild database into fresh file with hash table
+ * sized to its records count, then replace old file with it. Offline
+ * operation: fails with EBUSY if other processes have database open.
+ */
+int cmdb_compact (struct cmdb *o, struct cmdb_compact *s);
+
+/*
+ * Flush changes and write read-only snapshot of database to path. Open
+ * of snapshot file maps it into memory, values returned point into the
+ * mapping and stay valid until database closed.
+ */
+int cmdb_snapshot (struct cmdb *o, const char *path);
 
 #endif  /* CMDB_H */